@@ -1,15 +1,18 @@
 QT = core network sql
 
-CONFIG += c++17 cmdline
+CONFIG += c++20 cmdline
 
 # You can make your code fail to compile if it uses deprecated APIs.
 # In order to do so, uncomment the following line.
 #DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
 
 SOURCES += \
+        bufferpool.cpp \
         channel.cpp \
+        executor.cpp \
         main.cpp \
-        tcpserver.cpp
+        tcpserver.cpp \
+        upstream.cpp
 
 # Default rules for deployment.
 qnx: target.path = /tmp/$${TARGET}/bin
@@ -17,6 +20,10 @@ else: unix:!android: target.path = /opt/$${TARGET}/bin
 !isEmpty(target.path): INSTALLS += target
 
 HEADERS += \
+    bufferpool.h \
     channel.h \
+    epoch.h \
+    executor.h \
     singleaccess.h \
-    tcpserver.h
+    tcpserver.h \
+    upstream.h
@@ -0,0 +1,202 @@
+#include "bufferpool.h"
+#include <QMutex>
+#include <QList>
+#include <QVector>
+#include <QAtomicInteger>
+
+namespace {
+
+// Cached buffers per class and thread: about 1 MB, at least 4, at most 64
+int cacheLimit(int cls)
+{
+    const qsizetype size = BufferPool::MinClassSize << (2 * cls);
+    return int(qBound<qsizetype>(4, (1 << 20) / size, 64));
+}
+
+// Smallest class holding size, -1 if too large
+int classFor(qsizetype size)
+{
+    int cls = 0;
+    qsizetype cap = BufferPool::MinClassSize;
+    while (cap < size) {
+        if (++cls == BufferPool::ClassCount) return -1;
+        cap <<= 2;
+    }
+    return cls;
+}
+
+// Largest class a buffer of capacity satisfies, -1 if none
+int classOf(qsizetype capacity)
+{
+    if (capacity < BufferPool::MinClassSize) return -1;
+    int cls = 0;
+    qsizetype cap = BufferPool::MinClassSize;
+    while (cls + 1 < BufferPool::ClassCount && (cap << 2) <= capacity) {
+        ++cls;
+        cap <<= 2;
+    }
+    // Don't hoard buffers far beyond the class they would serve
+    return capacity <= cap * 4 ? cls : -1;
+}
+
+struct Counters
+{
+    // Written by the owning thread only, read by stats()
+    QAtomicInteger<quint64> hits{0};
+    QAtomicInteger<quint64> depotHits{0};
+    QAtomicInteger<quint64> misses{0};
+    QAtomicInteger<quint64> oversize{0};
+    QAtomicInteger<quint64> recycled{0};
+    QAtomicInteger<quint64> discarded{0};
+
+    static void bump(QAtomicInteger<quint64> &c) { c.storeRelaxed(c.loadRelaxed() + 1); }
+
+    void addTo(BufferPool::Stats &s) const
+    {
+        s.hits += hits.loadRelaxed();
+        s.depotHits += depotHits.loadRelaxed();
+        s.misses += misses.loadRelaxed();
+        s.oversize += oversize.loadRelaxed();
+        s.recycled += recycled.loadRelaxed();
+        s.discarded += discarded.loadRelaxed();
+    }
+};
+
+struct ThreadCache;
+
+// Buffers moved between threads in batches, plus stats registry
+struct Depot
+{
+    static const int MaxBatches = 64;   // per class
+
+    QMutex mutex;
+    QList<QVector<QByteArray>> batches[BufferPool::ClassCount];
+    QList<ThreadCache*> caches;
+    BufferPool::Stats retired{};
+
+    static Depot &instance()
+    {
+        static Depot depot;
+        return depot;
+    }
+
+    bool put(int cls, QVector<QByteArray> &&batch)
+    {
+        QMutexLocker locker(&mutex);
+        if (batches[cls].size() >= MaxBatches) return false;
+        batches[cls].append(std::move(batch));
+        return true;
+    }
+
+    bool take(int cls, QVector<QByteArray> &into)
+    {
+        QMutexLocker locker(&mutex);
+        if (batches[cls].isEmpty()) return false;
+        into = batches[cls].takeLast();
+        return true;
+    }
+};
+
+struct ThreadCache
+{
+    QVector<QByteArray> free[BufferPool::ClassCount];
+    Counters counters;
+
+    ThreadCache()
+    {
+        Depot &depot = Depot::instance();
+        QMutexLocker locker(&depot.mutex);
+        depot.caches.append(this);
+    }
+
+    ~ThreadCache()
+    {
+        Depot &depot = Depot::instance();
+        for (int cls = 0; cls < BufferPool::ClassCount; ++cls) {
+            if (!free[cls].isEmpty())
+                depot.put(cls, std::move(free[cls]));
+        }
+
+        QMutexLocker locker(&depot.mutex);
+        depot.caches.removeOne(this);
+        counters.addTo(depot.retired);
+    }
+
+    static ThreadCache &local()
+    {
+        static thread_local ThreadCache cache;
+        return cache;
+    }
+};
+
+} // namespace
+
+//--------------------------------------------------------------------------------
+
+QByteArray BufferPool::acquire(qsizetype size)
+{
+    ThreadCache &cache = ThreadCache::local();
+
+    const int cls = classFor(size);
+    if (cls < 0) {
+        Counters::bump(cache.counters.oversize);
+        QByteArray buffer;
+        buffer.reserve(size);
+        return buffer;
+    }
+
+    QVector<QByteArray> &free = cache.free[cls];
+    if (!free.isEmpty()) {
+        Counters::bump(cache.counters.hits);
+        return free.takeLast();
+    }
+    if (Depot::instance().take(cls, free)) {
+        Counters::bump(cache.counters.depotHits);
+        return free.takeLast();
+    }
+
+    Counters::bump(cache.counters.misses);
+    QByteArray buffer;
+    buffer.reserve(MinClassSize << (2 * cls));
+    return buffer;
+}
+
+void BufferPool::release(QByteArray &&buffer)
+{
+    QByteArray b = std::move(buffer);
+    ThreadCache &cache = ThreadCache::local();
+
+    const int cls = b.isDetached() ? classOf(b.capacity()) : -1;
+    if (cls < 0) {
+        Counters::bump(cache.counters.discarded);
+        return;
+    }
+
+    QVector<QByteArray> &free = cache.free[cls];
+    if (free.size() >= cacheLimit(cls)) {
+        // Hand the older half to other threads
+        const int half = free.size() / 2;
+        QVector<QByteArray> batch(std::make_move_iterator(free.begin()),
+                                  std::make_move_iterator(free.begin() + half));
+        free.remove(0, half);
+        if (!Depot::instance().put(cls, std::move(batch))) {
+            auto &d = cache.counters.discarded;
+            d.storeRelaxed(d.loadRelaxed() + quint64(half));   // depot full, they are freed
+        }
+    }
+
+    b.resize(0);    // keeps capacity
+    free.append(std::move(b));
+    Counters::bump(cache.counters.recycled);
+}
+
+BufferPool::Stats BufferPool::stats()
+{
+    Depot &depot = Depot::instance();
+    QMutexLocker locker(&depot.mutex);
+
+    Stats s = depot.retired;
+    for (const ThreadCache *cache : depot.caches)
+        cache->counters.addTo(s);
+    return s;
+}
@@ -0,0 +1,49 @@
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include <QByteArray>
+#include <QtGlobal>
+
+//--------------------------------------------------------------------------------
+/*!
+ * \brief BufferPool class recycles QByteArray storage of the I/O paths
+ *        (socket reads, framed messages, outbound frames and write chunks)
+ *        instead of a malloc/free pair per message.
+ *
+ *        Buffers are pooled in size classes of MinClassSize << (2 * n) bytes
+ *        (256 B .. 256 KB). Every thread keeps a small cache per class and
+ *        needs no lock for it; a full cache moves half of its buffers to a
+ *        global depot, an empty one takes a batch back, so buffers freed on
+ *        a worker thread return to the I/O thread that reads into them.
+ *
+ *        QByteArray b = BufferPool::acquire(n);   // empty, capacity() >= n
+ *        ...
+ *        BufferPool::release(std::move(b));       // kept only if not shared
+ */
+class BufferPool {
+public:
+    static const int ClassCount = 6;
+    static const qsizetype MinClassSize = 256;
+    static const qsizetype MaxClassSize = MinClassSize << (2 * (ClassCount - 1));
+
+    //! Empty buffer with capacity() >= size. Larger than MaxClassSize is allocated as usual.
+    static QByteArray acquire(qsizetype size);
+
+    //! Give buffer back. Shared buffers (still referenced elsewhere) are only dereferenced.
+    static void release(QByteArray &&buffer);
+
+    struct Stats
+    {
+        quint64 hits;       //!< served from the thread's cache
+        quint64 depotHits;  //!< served after refilling from the depot
+        quint64 misses;     //!< pooled size, newly allocated
+        quint64 oversize;   //!< above MaxClassSize, not pooled
+        quint64 recycled;   //!< released into a cache
+        quint64 discarded;  //!< released but shared, too small or cache and depot full
+    };
+
+    //! Totals of all threads, past and present.
+    static Stats stats();
+};
+
+#endif // BUFFERPOOL_H
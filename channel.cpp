@@ -1,70 +1,225 @@
 #include "channel.h"
+#include <atomic>
 
-void Channel::send(void* value) {
-    if(selector)
-    {
-        selector->send(selectId, value);
-        return;
-    }
+//--------------------------------------------------------------------------------
+
+ChannelBase::~ChannelBase()
+{
+    delete asyncSig.loadRelaxed();
+}
+
+SelectSignal* ChannelBase::asyncSignal()
+{
+    if (SelectSignal *s = asyncSig.loadAcquire())
+        return s;
 
     QMutexLocker locker(&mutex);
-    queue.enqueue(value);
-    cond.wakeOne();
+    if (!asyncSig.loadRelaxed())
+        asyncSig.storeRelease(new SelectSignal);
+    return asyncSig.loadRelaxed();
 }
 
-void* Channel::recv() {
+void ChannelBase::attach(const std::shared_ptr<SelectLink>& link)
+{
     QMutexLocker locker(&mutex);
-    while (queue.isEmpty()) {
-        cond.wait(&mutex);
-    }
-    return queue.dequeue();
+    addListener(link);
 }
 
-void Channel::capture(int id, Select* s)
+void ChannelBase::addListener(const std::shared_ptr<SelectLink>& link)
 {
-    selectId = id;
-    selector = s;
+    const Listeners *current = listeners.load();
+    auto *next = current ? new Listeners(*current) : new Listeners;
+    next->append(link);
+    listeners.publish(listenerEpoch, next);
+    listenerCount.fetchAndAddOrdered(1);
 }
 
-Select::Select(QList<SelectChannel> c)
+void ChannelBase::detach(const SelectLink* link)
 {
-    for(auto &cc: c)
-    {
-        cc.c->capture(cc.id, this);
-        sources.append(cc.c);
+    QMutexLocker locker(&mutex);
+    const Listeners *current = listeners.load();
+    if (!current) return;
+
+    auto next = std::make_unique<Listeners>();
+    for (auto &l : *current) {
+        if (l.get() != link)
+            next->append(l);
     }
+    if (next->count() == current->count()) return;
+
+    listeners.publish(listenerEpoch, next.release());
+    listenerCount.fetchAndAddOrdered(-1);
 }
-Select::~Select()
+
+void ChannelBase::pushed()
 {
-    for(auto &c: sources)
-    {
-        c->capture(0, nullptr);
-    }
+    wake(recvWaiters, notEmpty);
+
+    // Fenced by wake(), pairs with the receiver registering before it polls
+    SelectSignal *async = asyncSig.loadAcquire();
+    if (async && async->hasAsyncReceivers())
+        async->notify();
+
+    // wake() fenced already; a Select attached after this sees the message as backlog
+    if (listenerCount.loadRelaxed() == 0) return;
+
+    // No lock and no shared refcount, senders of a busy channel don't meet anywhere here
+    EpochDomain::ReadGuard guard(listenerEpoch);
+    const Listeners *l = listeners.load();
+    if (!l) return;
+    for (auto &link : *l)
+        link->signal->ready(link);
 }
 
-void Select::send(int id, void* value)
+void ChannelBase::wake(QAtomicInt &waiters, QWaitCondition &cond)
 {
+    // Pairs with the waiter's increment: either it sees our change, or we see it waiting.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiters.loadRelaxed() == 0) return;
+
     QMutexLocker locker(&mutex);
-    queue.enqueue({id, value});
     cond.wakeOne();
 }
 
-Select::ChannelData Select::recv()
+//--------------------------------------------------------------------------------
+
+void SelectSignal::notify()
+{
+    if (pending.fetchAndStoreOrdered(1) != 0) return;   // already pending
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiters.loadRelaxed() == 0) return;
+
+    QVector<std::function<void()>> fns;
+    {
+        QMutexLocker locker(&mutex);
+        cond.wakeAll();
+        fns.swap(asyncWaiters);
+        waiters.fetchAndAddOrdered(-int(fns.count()));
+    }
+
+    // Outside the lock, they may wait again right away
+    for (auto &fn : fns)
+        fn();
+}
+
+bool SelectSignal::waitAsync(std::function<void()> fn)
 {
     QMutexLocker locker(&mutex);
-    while (queue.isEmpty()) {
-        cond.wait(&mutex);
+    waiters.fetchAndAddOrdered(1);
+    if (pending.loadAcquire() != 0) {
+        waiters.fetchAndAddOrdered(-1);
+        return false;
     }
-    return queue.dequeue();
+    asyncWaiters.append(std::move(fn));
+    return true;
 }
 
-void Select::capture(int (*funcptr)(int id, void* d))
+void SelectSignal::ready(const std::shared_ptr<SelectLink>& link)
 {
-    while(true)
+    // Exchange (not load) pairs with Select clearing it before polling
+    if (link->queued.fetchAndStoreOrdered(1) != 0) return;
+
     {
-        auto d = recv();
+        QMutexLocker locker(&readyMutex);
+        if (link->state.loadAcquire() == SelectLink::Detached) return;
 
-        if(funcptr(d.id, d.data))
+        auto it = levels.begin();
+        while (it != levels.end() && it->priority > link->priority)
+            ++it;
+        if (it == levels.end() || it->priority != link->priority)
+            it = levels.insert(it, Level{link->priority, {}});
+        it->links.push_back(link);
+    }
+    notify();
+}
+
+std::shared_ptr<SelectLink> SelectSignal::takeReady()
+{
+    QMutexLocker locker(&readyMutex);
+    for (Level &level : levels) {
+        if (!level.links.empty()) {
+            std::shared_ptr<SelectLink> link = std::move(level.links.front());
+            level.links.pop_front();
+            return link;
+        }
+    }
+    return nullptr;
+}
+
+void SelectSignal::clearReady()
+{
+    QMutexLocker locker(&readyMutex);
+    levels.clear();
+}
+
+bool SelectSignal::wait(QDeadlineTimer deadline)
+{
+    QMutexLocker locker(&mutex);
+    waiters.fetchAndAddOrdered(1);
+    bool notified = true;
+    while (pending.loadAcquire() == 0) {
+        if (!cond.wait(&mutex, deadline)) {
+            notified = pending.loadAcquire() != 0;
             break;
+        }
     }
+    waiters.fetchAndAddOrdered(-1);
+    return notified;
+}
+
+//--------------------------------------------------------------------------------
+
+void CancelToken::cancel()
+{
+    cancelled.storeRelease(1);
+
+    QMutexLocker locker(&mutex);
+    for (SelectSignal *s : listeners)
+        s->notify();
+}
+
+void CancelToken::attach(SelectSignal* s)
+{
+    QMutexLocker locker(&mutex);
+    listeners.append(s);
+    if (isCancelled())
+        s->notify();
+}
+
+void CancelToken::detach(SelectSignal* s)
+{
+    QMutexLocker locker(&mutex);
+    listeners.removeOne(s);
+}
+
+//--------------------------------------------------------------------------------
+
+void TimerChannel::start()
+{
+    next = QDeadlineTimer(intervalMs);
+    active.storeRelease(1);
+}
+
+QDeadlineTimer TimerChannel::deadline() const
+{
+    if (!isActive())
+        return QDeadlineTimer(QDeadlineTimer::Forever);
+    return next;
+}
+
+quint64 TimerChannel::take()
+{
+    if (!isActive() || !next.hasExpired())
+        return 0;
+
+    // Coalesce periods missed while the consumer was busy
+    qint64 late = QDeadlineTimer::current() - next;
+    quint64 ticks = 1 + quint64(qMax<qint64>(late, 0) / intervalMs);
+
+    if (singleShot)
+        stop();
+    else
+        next += qint64(ticks) * intervalMs;
+    return ticks;
 }
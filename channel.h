@@ -1,64 +1,1152 @@
 #ifndef CHANNEL_H
 #define CHANNEL_H
 
-#include <QMap>
-#include <QQueue>
+#include <QList>
+#include <QHash>
+#include <QVector>
 #include <QMutex>
 #include <QWaitCondition>
+#include <QAtomicInteger>
+#include <QAtomicPointer>
+#include <QThread>
+#include <QDeadlineTimer>
+#include <coroutine>
+#include <deque>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <new>
+#include <optional>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
 
-class Select;
+#include "executor.h"
+#include "epoch.h"
 
-class Channel {
+class SelectSignal;
+template<class Source, class R> class AsyncReceive;
+
+//--------------------------------------------------------------------------------
+/*!
+ * \brief SelectLink is the membership of one channel (or timer) in one Select.
+ *        The channel keeps it to mark itself ready in that Select's ready
+ *        queue, so a Select only looks at channels that have messages.
+ */
+struct SelectLink
+{
+    enum State {
+        Idle,
+        Busy,       //!< being polled by the Select
+        Detached    //!< removed, never polled again
+    };
+
+    SelectLink(int id) : id(id) {}
+    virtual ~SelectLink() = default;
+
+    int id;
+    int priority = 0;
+    std::shared_ptr<SelectSignal> signal;
+    QAtomicInt queued{0};   // in the ready queue
+    QAtomicInt state{Idle};
+};
+
+//--------------------------------------------------------------------------------
+/*!
+ * \brief ChannelBase class holds the untyped part of Channel<T>: parking of
+ *        blocked senders/receivers and notification of attached Selects.
+ */
+class ChannelBase {
+public:
+    //! Used by Select: notify link's Select on every send from now on.
+    void attach(const std::shared_ptr<SelectLink>& link);
+    void detach(const SelectLink* link);
+
+protected:
+    ChannelBase() = default;
+    ~ChannelBase();
+
+    // Coroutine receivers park on this signal (created on first use), senders notify it
+    // directly while a receiver is registered on it
+    SelectSignal* asyncSignal();
+
+    // Spins of a blocking send/recv before it parks
+    static const int SpinCount = 64;
+
+    // After a push: wake a parked receiver, mark ready in attached Selects
+    void pushed();
+    // After a pop: wake a parked sender
+    void popped() { wake(sendWaiters, notFull); }
+
+    // Slow path only: parked threads
+    QMutex mutex;
+    QWaitCondition notEmpty;
+    QWaitCondition notFull;
+    QAtomicInt recvWaiters{0};
+    QAtomicInt sendWaiters{0};
+
+private:
+    // Wake one parked thread, if any (mutex not held)
+    void wake(QAtomicInt &waiters, QWaitCondition &cond);
+    // attach() with mutex held
+    void addListener(const std::shared_ptr<SelectLink>& link);
+
+    // Attached Selects, copy-on-write under mutex; senders read them in listenerEpoch
+    using Listeners = QVector<std::shared_ptr<SelectLink>>;
+    EpochDomain listenerEpoch;
+    EpochPtr<Listeners> listeners;
+    QAtomicInt listenerCount{0};
+
+    QAtomicPointer<SelectSignal> asyncSig;
+};
+
+//--------------------------------------------------------------------------------
+/*!
+ * \brief Channel class is a bounded lock-free queue of T (Vyukov ring buffer).
+ *        Messages are moved into and out of slots stored inline in the ring,
+ *        so sending never allocates. Any number of threads may send,
+ *        receivers never race on the same slot.
+ *        trySend/tryRecv never block. send/recv spin briefly, then park on a
+ *        wait condition until the other side makes progress, so a full channel
+ *        pushes back on its producers instead of growing.
+ *        A channel may be attached to several Selects (and read directly at
+ *        the same time), each message goes to exactly one of them.
+ */
+template<class T>
+class Channel : public ChannelBase {
+    static_assert(std::is_move_constructible_v<T>, "T must be move constructible");
+
+public:
+    explicit Channel(int capacity = 1024) {
+        // Round up to power of two, index is masked instead of divided
+        quint64 size = 2;
+        while (size < quint64(capacity)) size <<= 1;
+
+        mask = size - 1;
+        cells = new Cell[size];
+        for (quint64 i = 0; i < size; ++i)
+            cells[i].seq.storeRelaxed(i);
+    }
+
+    ~Channel() {
+        std::optional<T> v;
+        while (pop(v)) {}
+        delete[] cells;
+    }
+
+    Channel(const Channel&) = delete;
+    Channel& operator=(const Channel&) = delete;
+
+    //! Moves value in only on success.
+    bool trySend(T&& value) {
+        if (!push(value)) return false;
+        pushed();
+        return true;
+    }
+    bool trySend(const T& value) { T copy(value); return trySend(std::move(copy)); }
+
+    void send(T value) {
+        for (int i = 0; i < SpinCount; ++i) {
+            if (trySend(std::move(value))) return;
+            QThread::yieldCurrentThread();
+        }
+
+        {
+            QMutexLocker locker(&mutex);
+            sendWaiters.fetchAndAddOrdered(1);
+            while (!push(value)) {
+                notFull.wait(&mutex);
+            }
+            sendWaiters.fetchAndAddOrdered(-1);
+        }
+        pushed();
+    }
+
+    //! Send up to count values with one slot claim; moves from and returns number sent.
+    int trySendMany(T* values, int count) {
+        int n = pushMany(values, count);
+        if (n > 0) pushed();
+        return n;
+    }
+
+    //! Send all count values, blocking while the channel is full.
+    void sendMany(T* values, int count) {
+        int sent = 0;
+        for (int i = 0; i < SpinCount && sent < count; ++i) {
+            int n = trySendMany(values + sent, count - sent);
+            sent += n;
+            if (n == 0) QThread::yieldCurrentThread();
+        }
+        if (sent == count) return;
+
+        {
+            QMutexLocker locker(&mutex);
+            sendWaiters.fetchAndAddOrdered(1);
+            while (sent < count) {
+                int n = pushMany(values + sent, count - sent);
+                sent += n;
+                if (n > 0) {
+                    // Let the receiver drain while we wait for the rest
+                    locker.unlock();
+                    pushed();
+                    locker.relock();
+                } else {
+                    notFull.wait(&mutex);
+                }
+            }
+            sendWaiters.fetchAndAddOrdered(-1);
+        }
+    }
+
+    bool tryRecv(std::optional<T>& value) {
+        if (!pop(value)) return false;
+        popped();
+        return true;
+    }
+    bool tryRecv(T& value) {
+        std::optional<T> v;
+        if (!tryRecv(v)) return false;
+        value = std::move(*v);
+        return true;
+    }
+
+    T recv() {
+        std::optional<T> v;
+        for (int i = 0; i < SpinCount; ++i) {
+            if (tryRecv(v)) return std::move(*v);
+            QThread::yieldCurrentThread();
+        }
+
+        {
+            QMutexLocker locker(&mutex);
+            recvWaiters.fetchAndAddOrdered(1);
+            while (!pop(v)) {
+                notEmpty.wait(&mutex);
+            }
+            recvWaiters.fetchAndAddOrdered(-1);
+        }
+        popped();
+        return std::move(*v);
+    }
+
+    //! Receive, waiting at most until deadline; false on timeout.
+    bool recv(std::optional<T>& value, QDeadlineTimer deadline) {
+        for (int i = 0; i < SpinCount; ++i) {
+            if (tryRecv(value)) return true;
+            if (deadline.hasExpired()) return false;
+            QThread::yieldCurrentThread();
+        }
+
+        bool ok;
+        {
+            QMutexLocker locker(&mutex);
+            recvWaiters.fetchAndAddOrdered(1);
+            while (!(ok = pop(value))) {
+                if (!notEmpty.wait(&mutex, deadline)) {
+                    ok = pop(value);    // last look, a send may have raced the timeout
+                    break;
+                }
+            }
+            recvWaiters.fetchAndAddOrdered(-1);
+        }
+        if (ok) popped();
+        return ok;
+    }
+    bool recv(T& value, QDeadlineTimer deadline) {
+        std::optional<T> v;
+        if (!recv(v, deadline)) return false;
+        value = std::move(*v);
+        return true;
+    }
+
+    //! Receive up to max messages with one slot claim into out; returns number received.
+    int tryRecvMany(T* out, int max) {
+        int n = popMany(max, [&out](T&& v) { *out++ = std::move(v); });
+        if (n > 0) popped();
+        return n;
+    }
+
+    //! Receive up to max messages, blocking until at least one is available.
+    int recvMany(T* out, int max) {
+        for (int i = 0; i < SpinCount; ++i) {
+            if (int n = tryRecvMany(out, max)) return n;
+            QThread::yieldCurrentThread();
+        }
+
+        int n;
+        {
+            QMutexLocker locker(&mutex);
+            recvWaiters.fetchAndAddOrdered(1);
+            while ((n = popMany(max, [&out](T&& v) { *out++ = std::move(v); })) == 0) {
+                notEmpty.wait(&mutex);
+            }
+            recvWaiters.fetchAndAddOrdered(-1);
+        }
+        popped();
+        return n;
+    }
+
+    //! Hand up to max messages to f(T&&) with one slot claim, without blocking; senders waiting for room are woken.
+    template<class F>
+    int consumeMany(int max, F&& f) {
+        int n = popMany(max, std::forward<F>(f));
+        if (n > 0) popped();
+        return n;
+    }
+
+    //! co_await ch.recvAsync(executor): suspend the coroutine, not the thread, until a message
+    //! arrives; it resumes on executor (on the sending thread if null).
+    AsyncReceive<Channel<T>, T> recvAsync(Executor* executor = nullptr);
+
+    int capacity() const { return int(mask + 1); }
+
+private:
+    template<class Source, class R> friend class AsyncReceive;
+
+    bool takeAsync(std::optional<T>& value) { return tryRecv(value); }
+
+    struct Cell
+    {
+        QAtomicInteger<quint64> seq;
+        alignas(T) unsigned char storage[sizeof(T)];
+
+        T* value() { return std::launder(reinterpret_cast<T*>(storage)); }
+    };
+
+    Cell* cells;
+    quint64 mask;
+
+    // Producers and consumers hammer different cache lines
+    alignas(64) QAtomicInteger<quint64> enqueuePos{0};
+    alignas(64) QAtomicInteger<quint64> dequeuePos{0};
+
+    // Ring operations, no waking. push moves from value only on success.
+    bool push(T& value) {
+        quint64 pos = enqueuePos.loadRelaxed();
+        for (;;) {
+            Cell &cell = cells[pos & mask];
+            qint64 diff = qint64(cell.seq.loadAcquire()) - qint64(pos);
+
+            if (diff == 0) {
+                // Slot free at our position, claim it
+                if (enqueuePos.testAndSetRelaxed(pos, pos + 1, pos)) {
+                    new (cell.storage) T(std::move(value));
+                    cell.seq.storeRelease(pos + 1);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;   // full
+            } else {
+                pos = enqueuePos.loadRelaxed();
+            }
+        }
+    }
+
+    // Claim up to count consecutive free slots with one CAS
+    int pushMany(T* values, int count) {
+        quint64 pos = enqueuePos.loadRelaxed();
+        for (;;) {
+            int n = 0;
+            while (n < count && cells[(pos + n) & mask].seq.loadAcquire() == pos + n)
+                ++n;
+
+            if (n == 0) {
+                Cell &cell = cells[pos & mask];
+                if (qint64(cell.seq.loadAcquire()) - qint64(pos) < 0)
+                    return 0;   // full
+                pos = enqueuePos.loadRelaxed();
+                continue;
+            }
+
+            if (enqueuePos.testAndSetRelaxed(pos, pos + n, pos)) {
+                for (int i = 0; i < n; ++i) {
+                    Cell &cell = cells[(pos + i) & mask];
+                    new (cell.storage) T(std::move(values[i]));
+                    cell.seq.storeRelease(pos + i + 1);
+                }
+                return n;
+            }
+        }
+    }
+
+    // Claim up to max consecutive ready slots with one CAS, hand each to f(T&&)
+    template<class F>
+    int popMany(int max, F&& f) {
+        quint64 pos = dequeuePos.loadRelaxed();
+        for (;;) {
+            int n = 0;
+            while (n < max && cells[(pos + n) & mask].seq.loadAcquire() == pos + n + 1)
+                ++n;
+
+            if (n == 0) {
+                Cell &cell = cells[pos & mask];
+                if (qint64(cell.seq.loadAcquire()) - qint64(pos + 1) < 0)
+                    return 0;   // empty
+                pos = dequeuePos.loadRelaxed();
+                continue;
+            }
+
+            if (dequeuePos.testAndSetRelaxed(pos, pos + n, pos)) {
+                for (int i = 0; i < n; ++i) {
+                    Cell &cell = cells[(pos + i) & mask];
+                    f(std::move(*cell.value()));
+                    cell.value()->~T();
+                    cell.seq.storeRelease(pos + i + mask + 1);
+                }
+                return n;
+            }
+        }
+    }
+
+    bool pop(std::optional<T>& value) {
+        quint64 pos = dequeuePos.loadRelaxed();
+        for (;;) {
+            Cell &cell = cells[pos & mask];
+            qint64 diff = qint64(cell.seq.loadAcquire()) - qint64(pos + 1);
+
+            if (diff == 0) {
+                if (dequeuePos.testAndSetRelaxed(pos, pos + 1, pos)) {
+                    value.emplace(std::move(*cell.value()));
+                    cell.value()->~T();
+                    cell.seq.storeRelease(pos + mask + 1);   // free for next lap
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;   // empty
+            } else {
+                pos = dequeuePos.loadRelaxed();
+            }
+        }
+    }
+};
+
+//--------------------------------------------------------------------------------
+/*!
+ * \brief SelectSignal class is the wake-up and ready queue of a Select:
+ *        channels queue their link on send, Select takes ready links and
+ *        parks on it when none is left.
+ *        Ready links are served highest priority first, round-robin within
+ *        one priority.
+ */
+class SelectSignal {
 public:
-    void send(void* value);
+    //! Called by a channel after a send.
+    void notify();
+
+    //! Queue link (once until it is taken) and notify.
+    void ready(const std::shared_ptr<SelectLink>& link);
+
+    //! Next ready link, null if none.
+    std::shared_ptr<SelectLink> takeReady();
 
-    void* recv();
+    //! Drop all queued links.
+    void clearReady();
 
-    void capture(int id, Select* s);
+    //! Run fn once on the next notify(), instead of parking a thread in wait().
+    //! False (fn dropped) if notified since reset().
+    bool waitAsync(std::function<void()> fn);
+
+    //! Forget earlier notifications, call before scanning channels.
+    void reset() { pending.fetchAndStoreOrdered(0); }
+
+    //! Coroutine receivers between suspending and taking their result; a channel
+    //! notifies its async signal only while there is one.
+    void addAsyncReceiver() { asyncReceivers.fetchAndAddOrdered(1); }
+    void removeAsyncReceiver() { asyncReceivers.fetchAndAddOrdered(-1); }
+    bool hasAsyncReceivers() const { return asyncReceivers.loadRelaxed() != 0; }
+
+    //! Park until notify() or deadline (returns at once if notified since reset()).
+    //! False on timeout.
+    bool wait(QDeadlineTimer deadline = QDeadlineTimer(QDeadlineTimer::Forever));
 
 private:
-    QQueue<void*> queue;
+    QAtomicInt pending{0};
+    QAtomicInt waiters{0};
+    QAtomicInt asyncReceivers{0};
     QMutex mutex;
     QWaitCondition cond;
+    QVector<std::function<void()>> asyncWaiters;
+
+    struct Level
+    {
+        int priority;
+        std::deque<std::shared_ptr<SelectLink>> links;
+    };
+
+    QMutex readyMutex;
+    std::vector<Level> levels;  // by descending priority
+};
+
+//--------------------------------------------------------------------------------
+/*!
+ * \brief CancelToken class stops every Select watching it. cancel() may be
+ *        called from any thread and wakes a parked capture() at once, so
+ *        shutdown needs no dummy message.
+ */
+class CancelToken {
+public:
+    void cancel();
+    bool isCancelled() const { return cancelled.loadAcquire() != 0; }
+
+    //! Arm again for reuse.
+    void reset() { cancelled.storeRelease(0); }
+
+    //! Used by Select.
+    void attach(SelectSignal* s);
+    void detach(SelectSignal* s);
+
+private:
+    QAtomicInt cancelled{0};
+    QMutex mutex;
+    QList<SelectSignal*> listeners;
+};
+
+//--------------------------------------------------------------------------------
+//! Message of a TimerChannel: number of periods elapsed since the last one
+//! (more than 1 when the consumer fell behind, ticks are coalesced).
+struct TimerTick
+{
+    quint64 count;
+};
+
+/*!
+ * \brief TimerChannel class is a Select source firing every interval ms.
+ *        It has no thread or QTimer of its own: the Select sleeps no longer
+ *        than the next due time and delivers a TimerTick then, in between
+ *        ordinary messages. Schedule is kept against the first start, it
+ *        doesn't drift with delivery latency.
+ *        Start/stop from the consuming thread or before capture().
+ */
+class TimerChannel {
+public:
+    explicit TimerChannel(qint64 intervalMs, bool singleShot = false)
+        : intervalMs(qMax<qint64>(intervalMs, 1)), singleShot(singleShot) { start(); }
+
+    void start();
+    void stop() { active.storeRelease(0); }
+    bool isActive() const { return active.loadAcquire() != 0; }
+    qint64 interval() const { return intervalMs; }
+
+    //! When the next tick is due (Forever if stopped).
+    QDeadlineTimer deadline() const;
+
+    //! Elapsed ticks, 0 if not due yet; reschedules.
+    quint64 take();
+
+private:
+    qint64 intervalMs;
+    bool singleShot;
+    QAtomicInt active{0};
+    QDeadlineTimer next;
+};
+
+//--------------------------------------------------------------------------------
+/*!
+ * \brief AsyncTask is the return type of a fire-and-forget coroutine: it runs
+ *        at once up to its first suspension and frees itself when done.
+ *
+ *        AsyncTask consume(Channel<int>& ch, Executor* ex) {
+ *            while (true) handle(co_await ch.recvAsync(ex));
+ *        }
+ */
+struct AsyncTask
+{
+    struct promise_type
+    {
+        AsyncTask get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+/*!
+ * \brief AsyncReceive is the awaiter of Channel::recvAsync() and Select::next().
+ *        It polls source->takeAsync() and, while nothing is there, parks the
+ *        coroutine on signal. A wake-up that finds nothing (another consumer
+ *        was faster) parks it again, so the coroutine only resumes with a result.
+ */
+template<class Source, class R>
+class AsyncReceive {
+public:
+    AsyncReceive(Source* source, SelectSignal* signal, Executor* executor)
+        : source(source), signal(signal), executor(executor) {}
+
+    bool await_ready() { return source->takeAsync(result); }
+
+    bool await_suspend(std::coroutine_handle<> h)
+    {
+        handle = h;
+        // Before polling again: either a send sees us registered, or we see its message
+        signal->addAsyncReceiver();
+        return park();
+    }
+
+    R await_resume() { return std::move(*result); }
+
+private:
+    // True once parked; false if a result was taken instead.
+    // Once parked, this may be resumed (and destroyed) at any time.
+    bool park()
+    {
+        while(true)
+        {
+            signal->reset();
+            if(source->takeAsync(result))
+            {
+                signal->removeAsyncReceiver();
+                return false;
+            }
+            if(signal->waitAsync([this]() { wake(); }))
+                return true;
+        }
+    }
+
+    void wake()
+    {
+        auto retry = [this]() {
+            if(!park())
+                handle.resume();
+        };
+        if(executor)
+            executor->post(retry);
+        else
+            retry();
+    }
 
-    int selectId;
-    Select* selector{nullptr};
+    Source* source;
+    SelectSignal* signal;
+    Executor* executor;
+    std::coroutine_handle<> handle;
+    std::optional<R> result;
 };
 
+template<class T>
+AsyncReceive<Channel<T>, T> Channel<T>::recvAsync(Executor* executor)
+{
+    return AsyncReceive<Channel<T>, T>(this, asyncSignal(), executor);
+}
+
+//--------------------------------------------------------------------------------
+/*!
+ * \brief Select class receives from several channels, possibly of different
+ *        message types, in one thread. Ts are the (distinct) message types.
+ *
+ *        Channel<int> a; Channel<QString> b;
+ *        Select<int, QString> sel({{1, &a}, {2, &b}});
+ *        sel.capture([](int id, auto&& msg) -> int { ...; return 0; });
+ *
+ *        The visitor is called as int(int id, T&& msg) for every message;
+ *        it must accept every T (checked at compile time). Returning nonzero
+ *        ends capture().
+ *
+ *        captureBatch() hands runs of up to BatchSize messages of one channel
+ *        at once, as int(int id, T* msgs, int count), one slot claim per run.
+ *
+ *        Both also end on their deadline, on cancel() or on the CancelToken
+ *        set with setCancelToken(). A TimerChannel attached like a channel
+ *        delivers TimerTick, so TimerTick must then be one of Ts.
+ *
+ *        Channels are added and removed at any time, from any thread (also
+ *        from inside the visitor); ids are unique within a Select. A channel
+ *        only costs something while it has messages: sends put it in the
+ *        ready queue, capture() serves ready channels one message (or run)
+ *        per turn, higher priority first, round-robin within a priority.
+ *        Messages queued before add() are delivered too.
+ *
+ *        Instead of blocking a thread in capture(), a coroutine can loop on
+ *        co_await next(), see AsyncReceive.
+ */
+template<class... Ts>
 class Select
 {
+    struct SourceBase;
+
 public:
 
+    enum CaptureResult {
+        Stopped,    //!< visitor returned nonzero
+        TimedOut,
+        Cancelled
+    };
+
     struct SelectChannel
     {
+        template<class T>
+        SelectChannel(int id, Channel<T>* c, int priority = 0)
+            : id(id), priority(priority), target(c), make(&Select::makeSource<T>) {}
+        SelectChannel(int id, TimerChannel* t, int priority = 0)
+            : id(id), priority(priority), target(t), make(&Select::makeTimerSource) {}
+
         int id;
-        Channel* c;
+        int priority;
+        void* target;
+        SourceBase* (*make)(int id, void* target);
     };
 
-    Select(QList<SelectChannel>);
-    ~Select();
+    Select(std::initializer_list<SelectChannel> c)
+    {
+        for(auto &cc: c)
+            add(cc);
+    }
+    ~Select()
+    {
+        setCancelToken(nullptr);
+
+        QMutexLocker locker(&sourcesMutex);
+        for(auto &s: sources)
+            unlink(s.get());
+        sources.clear();
+        timers.clear();
+        signal->clearReady();
+    }
 
-    void send(int id, void* value);
+    Select(const Select&) = delete;
+    Select& operator=(const Select&) = delete;
 
-    void capture(int (*funcptr)(int id, void* d));
+    //! Start receiving from c; false if its id is taken.
+    bool add(const SelectChannel& c)
+    {
+        std::shared_ptr<SourceBase> s(c.make(c.id, c.target));
+        s->priority = c.priority;
+        s->signal = signal;
 
-    bool IsRun = true;
+        {
+            QMutexLocker locker(&sourcesMutex);
+            if(sources.contains(c.id))
+                return false;
+            sources.insert(c.id, s);
+            if(!s->channel())
+                timers.append(s);
+        }
 
-private:
+        if(ChannelBase *ch = s->channel())
+        {
+            ch->attach(s);
+            signal->ready(s);   // drain what was sent before attach
+        }
+        else
+            signal->notify();   // capture() picks up the new due time
+        return true;
+    }
+
+    template<class T>
+    bool add(int id, Channel<T>* c, int priority = 0) { return add(SelectChannel(id, c, priority)); }
+    bool add(int id, TimerChannel* t, int priority = 0) { return add(SelectChannel(id, t, priority)); }
+
+    /*!
+     * Stop receiving from channel id. Once it returns the channel is not
+     * touched by this Select anymore and may be destroyed.
+     */
+    bool remove(int id)
+    {
+        std::shared_ptr<SourceBase> s;
+        {
+            QMutexLocker locker(&sourcesMutex);
+            s = sources.take(id);
+            if(!s)
+                return false;
+            timers.removeOne(s);
+        }
+
+        // Inside the visitor the link may be Busy with our own poll
+        if(captureThread.loadAcquire() == QThread::currentThread())
+        {
+            if(ChannelBase *ch = s->channel())
+                ch->detach(s.get());
+            s->state.fetchAndStoreOrdered(SelectLink::Detached);
+        }
+        else
+            unlink(s.get());
+        return true;
+    }
+
+    int count() const
+    {
+        QMutexLocker locker(&sourcesMutex);
+        return sources.count();
+    }
+
+    //! Also end capture() when token is cancelled (token must outlive the Select, or be unset).
+    void setCancelToken(CancelToken* token)
+    {
+        if(cancelToken) cancelToken->detach(signal.get());
+        cancelToken = token;
+        if(cancelToken) cancelToken->attach(signal.get());
+    }
+
+    //! Make the running capture() return Cancelled, and every later one until resetCancel(); any thread.
+    void cancel()
+    {
+        cancelled.storeRelease(1);
+        signal->notify();
+    }
+    //! Arm again for reuse (the CancelToken, if any, is reset separately).
+    void resetCancel() { cancelled.storeRelease(0); }
+    bool isCancelled() const
+    {
+        return cancelled.loadAcquire() != 0 || (cancelToken && cancelToken->isCancelled());
+    }
 
-    QList<Channel*> sources;
+    template<class Visitor>
+    CaptureResult capture(Visitor&& visitor, QDeadlineTimer deadline = QDeadlineTimer(QDeadlineTimer::Forever))
+    {
+        const Dispatch d = dispatchFor(visitor);
+        return run(deadline, [&d](SourceBase* s, int& stop) { return s->poll(d, stop); });
+    }
+
+    //! Largest run handed to a captureBatch() visitor
+    static const int BatchSize = 256;
 
-    struct ChannelData
+    template<class Visitor>
+    CaptureResult captureBatch(Visitor&& visitor, QDeadlineTimer deadline = QDeadlineTimer(QDeadlineTimer::Forever))
+    {
+        using V = std::remove_reference_t<Visitor>;
+        static_assert((std::is_invocable_r_v<int, V&, int, Ts*, int> && ...),
+                      "visitor must be callable as int(int id, T* msgs, int count) for every message type");
+
+        const BatchDispatch d{ const_cast<void*>(static_cast<const void*>(std::addressof(visitor))),
+                               std::make_tuple(&invokeBatch<V, Ts>...) };
+        return run(deadline, [&d](SourceBase* s, int& stop) { return s->pollMany(d, stop); });
+    }
+
+    //! Deliver at most one message to visitor without blocking; false if none was ready.
+    template<class Visitor>
+    bool tryRecv(Visitor&& visitor)
+    {
+        const Dispatch d = dispatchFor(visitor);
+        auto poll = [&d](SourceBase* s, int& stop) { return s->poll(d, stop); };
+        CaptureScope scope(this);
+
+        QDeadlineTimer wake(QDeadlineTimer::Forever);
+        int stop = 0;
+        for(auto &t: dueTimers(wake))
+        {
+            if(serve(t, poll, stop))
+                return true;
+        }
+        while(auto link = signal->takeReady())
+        {
+            if(serve(link, poll, stop))
+                return true;
+        }
+        return false;
+    }
+
+    //! A message as returned by next()
+    struct Message
     {
         int id;
-        void* data;
+        std::variant<Ts...> value;
     };
 
-    ChannelData recv();
+    /*!
+     * co_await sel.next(executor): suspend the coroutine, not the thread, until a
+     * message arrives; it resumes on executor (on the sending thread if null).
+     * Yields no message once cancelled. One next() awaiting per Select at a time;
+     * due TimerChannel ticks are picked up whenever next() polls.
+     */
+    AsyncReceive<Select, std::optional<Message>> next(Executor* executor = nullptr)
+    {
+        return AsyncReceive<Select, std::optional<Message>>(this, signal.get(), executor);
+    }
 
-    QQueue<ChannelData> queue;
-    QMutex mutex;
-    QWaitCondition cond;
+    //! Send count values to the channel attached with id; returns number sent (0 on id/type mismatch).
+    template<class T>
+    int sendMany(int id, T* values, int count)
+    {
+        std::shared_ptr<SourceBase> s;
+        {
+            QMutexLocker locker(&sourcesMutex);
+            s = sources.value(id);
+        }
+        auto *typed = dynamic_cast<Source<T>*>(s.get());
+        if(!typed)
+            return 0;
+        typed->typedChannel->sendMany(values, count);
+        return count;
+    }
+
+private:
+    template<class Source, class R> friend class AsyncReceive;
+
+    bool takeAsync(std::optional<std::optional<Message>>& result)
+    {
+        if(isCancelled())
+        {
+            result.emplace(std::nullopt);
+            return true;
+        }
+        return tryRecv([&result](int id, auto&& msg) -> int {
+            using T = std::decay_t<decltype(msg)>;
+            result.emplace(Message{ id, std::variant<Ts...>(std::in_place_type<T>, std::move(msg)) });
+            return 0;
+        });
+    }
+
+    // Ready links served per turn before timers and cancel are looked at again
+    static const int TurnLinks = 64;
+
+    // One typed call per message type, picked by the source's T
+    struct Dispatch
+    {
+        void* visitor;
+        std::tuple<int (*)(void*, int, Ts&&)...> fns;
+    };
+
+    struct BatchDispatch
+    {
+        void* visitor;
+        std::tuple<int (*)(void*, int, Ts*, int)...> fns;
+    };
+
+    template<class V, class T>
+    static int invoke(void* visitor, int id, T&& msg)
+    {
+        return (*static_cast<V*>(visitor))(id, std::move(msg));
+    }
+
+    template<class V, class T>
+    static int invokeBatch(void* visitor, int id, T* msgs, int count)
+    {
+        return (*static_cast<V*>(visitor))(id, msgs, count);
+    }
+
+    template<class Visitor>
+    static Dispatch dispatchFor(Visitor& visitor)
+    {
+        using V = std::remove_reference_t<Visitor>;
+        static_assert((std::is_invocable_r_v<int, V&, int, Ts&&> && ...),
+                      "visitor must be callable as int(int id, T&&) for every message type");
+
+        return Dispatch{ const_cast<void*>(static_cast<const void*>(std::addressof(visitor))),
+                         std::make_tuple(&invoke<V, Ts>...) };
+    }
+
+    // Marks the thread running the visitor, for remove() from inside it
+    struct CaptureScope
+    {
+        explicit CaptureScope(Select* s) : s(s) { s->captureThread.storeRelease(QThread::currentThread()); }
+        ~CaptureScope() { s->captureThread.storeRelease(nullptr); }
+        Select* s;
+    };
+
+    // Serve ready links until the visitor stops, deadline passes or cancelled;
+    // park in between, no longer than the earliest timer.
+    template<class Poll>
+    CaptureResult run(QDeadlineTimer deadline, Poll&& poll)
+    {
+        CaptureScope scope(this);
+
+        while(true)
+        {
+            signal->reset();
+            if(isCancelled())
+                return Cancelled;
+            // Checked every turn, busy channels must not keep a capture past its deadline
+            if(deadline.hasExpired())
+                return TimedOut;
+
+            bool any = false;
+            int stop = 0;
+            QDeadlineTimer wake = deadline;
+
+            for(auto &t: dueTimers(wake))
+            {
+                if(serve(t, poll, stop))
+                {
+                    any = true;
+                    if(stop) return Stopped;
+                }
+            }
+
+            // Links queued by sends already consumed elsewhere come up empty,
+            // so park only once the queue ran dry
+            bool drained = false;
+            for(int n = 0; n < TurnLinks; ++n)
+            {
+                std::shared_ptr<SelectLink> link = signal->takeReady();
+                if(!link)
+                {
+                    drained = true;
+                    break;
+                }
+                if(serve(link, poll, stop))
+                {
+                    any = true;
+                    if(stop) return Stopped;
+                }
+            }
+
+            if(!any && drained)
+            {
+                if(deadline.hasExpired())
+                    return TimedOut;
+                signal->wait(wake);
+            }
+        }
+    }
+
+    // Poll one link once; a channel that delivered goes to the back of the queue
+    template<class Poll>
+    bool serve(const std::shared_ptr<SelectLink>& link, Poll& poll, int& stop)
+    {
+        // Clear before polling: a send after this queues the link again
+        link->queued.fetchAndStoreOrdered(0);
+        if(!link->state.testAndSetOrdered(SelectLink::Idle, SelectLink::Busy))
+            return false;   // detached
+
+        auto *s = static_cast<SourceBase*>(link.get());
+        bool got = poll(s, stop);
+        link->state.testAndSetRelease(SelectLink::Busy, SelectLink::Idle);
+
+        if(got && s->channel())
+            signal->ready(link);
+        return got;
+    }
+
+    // Timers with ticks pending; wake is lowered to the earliest due time
+    QVector<std::shared_ptr<SelectLink>> dueTimers(QDeadlineTimer& wake)
+    {
+        QVector<std::shared_ptr<SelectLink>> due;
+
+        QMutexLocker locker(&sourcesMutex);
+        for(auto &t: timers)
+        {
+            if(t->take())
+                due.append(t);
+            QDeadlineTimer next = t->due();
+            if(next < wake)
+                wake = next;
+        }
+        return due;
+    }
+
+    // Detach s and wait out a poll in progress on another thread
+    static void unlink(SourceBase* s)
+    {
+        if(ChannelBase *ch = s->channel())
+            ch->detach(s);
+
+        while(!s->state.testAndSetOrdered(SelectLink::Idle, SelectLink::Detached))
+        {
+            if(s->state.loadAcquire() == SelectLink::Detached)
+                break;
+            QThread::yieldCurrentThread();
+        }
+    }
+
+    struct SourceBase : SelectLink
+    {
+        using SelectLink::SelectLink;
+
+        // The channel notifying this source, null for timers
+        virtual ChannelBase* channel() const { return nullptr; }
+
+        // Deliver one message if any; stop is the visitor's result
+        virtual bool poll(const Dispatch& d, int& stop) = 0;
+
+        // Deliver a run of messages if any
+        virtual bool pollMany(const BatchDispatch& d, int& stop) = 0;
+
+        // Timers: collect elapsed ticks (true if any pending), and next due time
+        virtual bool take() { return false; }
+        virtual QDeadlineTimer due() const { return QDeadlineTimer(QDeadlineTimer::Forever); }
+    };
+
+    template<class T>
+    struct Source : SourceBase
+    {
+        Source(int id, Channel<T>* c) : SourceBase(id), typedChannel(c) {}
+
+        ChannelBase* channel() const override { return typedChannel; }
+
+        bool poll(const Dispatch& d, int& stop) override
+        {
+            std::optional<T> msg;
+            if(!typedChannel->tryRecv(msg))
+                return false;
+            stop = std::get<int (*)(void*, int, T&&)>(d.fns)(d.visitor, this->id, std::move(*msg));
+            return true;
+        }
+
+        bool pollMany(const BatchDispatch& d, int& stop) override
+        {
+            // Slots are released as soon as the run is moved out, before the visitor runs
+            int n = typedChannel->consumeMany(BatchSize, [this](T&& v) {
+                scratch.push_back(std::move(v));
+            });
+            if(n == 0)
+                return false;
+            stop = std::get<int (*)(void*, int, T*, int)>(d.fns)(d.visitor, this->id, scratch.data(), n);
+            scratch.clear();    // keeps capacity
+            return true;
+        }
+
+        Channel<T>* typedChannel;
+        std::vector<T> scratch;
+    };
+
+    struct TimerSource : SourceBase
+    {
+        TimerSource(int id, TimerChannel* t) : SourceBase(id), timer(t) {}
+
+        bool poll(const Dispatch& d, int& stop) override
+        {
+            if(pending == 0)
+                return false;
+            TimerTick tick{ pending };
+            pending = 0;
+            stop = std::get<int (*)(void*, int, TimerTick&&)>(d.fns)(d.visitor, this->id, std::move(tick));
+            return true;
+        }
+
+        bool pollMany(const BatchDispatch& d, int& stop) override
+        {
+            if(pending == 0)
+                return false;
+            TimerTick tick{ pending };
+            pending = 0;
+            stop = std::get<int (*)(void*, int, TimerTick*, int)>(d.fns)(d.visitor, this->id, &tick, 1);
+            return true;
+        }
+
+        bool take() override
+        {
+            pending += timer->take();
+            return pending != 0;
+        }
+
+        QDeadlineTimer due() const override { return timer->deadline(); }
+
+        TimerChannel* timer;
+        quint64 pending = 0;    // ticks taken, not yet delivered
+    };
+
+    template<class T>
+    static SourceBase* makeSource(int id, void* target)
+    {
+        static_assert((std::is_same_v<T, Ts> || ...), "channel type is not one of Select's message types");
+        return new Source<T>(id, static_cast<Channel<T>*>(target));
+    }
+
+    static SourceBase* makeTimerSource(int id, void* target)
+    {
+        static_assert((std::is_same_v<TimerTick, Ts> || ...), "TimerTick must be one of Select's message types");
+        return new TimerSource(id, static_cast<TimerChannel*>(target));
+    }
+
+    mutable QMutex sourcesMutex;
+    QHash<int, std::shared_ptr<SourceBase>> sources;
+    QVector<std::shared_ptr<SourceBase>> timers;
+
+    std::shared_ptr<SelectSignal> signal{std::make_shared<SelectSignal>()};
+    QAtomicInt cancelled{0};
+    CancelToken* cancelToken{nullptr};
+    QAtomicPointer<QThread> captureThread{nullptr};
 };
 
 #endif // CHANNEL_H
@@ -0,0 +1,151 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <QThread>
+#include <QVector>
+#include <atomic>
+
+//--------------------------------------------------------------------------------
+/*!
+ * \brief EpochDomain class frees objects writers took out of an EpochPtr once no
+ *        reader can still use them, so readers need neither a lock nor a
+ *        shared_ptr refcount (std::atomic_load on shared_ptr is a global mutex
+ *        pool in libstdc++).
+ *        - a ReadGuard increments one of the domain's two reader counters on
+ *          entry and decrements it on exit;
+ *        - retire() flips the epoch, new readers count on the other counter, and
+ *          frees an object once both counters were seen at zero after it was
+ *          unpublished;
+ *        - writers never wait for readers long: what may still be read is kept
+ *          and freed by a later retire() or by the destructor, or synchronize()
+ *          blocks until it is freed (for objects holding resources).
+ *        Writers must be serialized by the caller.
+ *
+ *        {
+ *            EpochDomain::ReadGuard guard(domain);
+ *            const T *v = ptr.load();      // valid until guard ends
+ *        }
+ */
+class EpochDomain {
+public:
+    EpochDomain() = default;
+    //! No reader may be left.
+    ~EpochDomain() {
+        for (const auto &r : retired)
+            r.destroy(r.object);
+    }
+
+    EpochDomain(const EpochDomain&) = delete;
+    EpochDomain& operator=(const EpochDomain&) = delete;
+
+    class ReadGuard {
+    public:
+        explicit ReadGuard(const EpochDomain &domain)
+            : counter(&domain.readers[domain.epoch.load(std::memory_order_relaxed) & 1].count) {
+            counter->fetch_add(1, std::memory_order_seq_cst);
+        }
+        ~ReadGuard() { counter->fetch_sub(1, std::memory_order_release); }
+
+        ReadGuard(const ReadGuard&) = delete;
+        ReadGuard& operator=(const ReadGuard&) = delete;
+
+    private:
+        std::atomic<int> *counter;
+    };
+
+    //! Free \a object once no reader can hold it; call after unpublishing it.
+    template<class T>
+    void retire(const T *object) {
+        retired.append({object, [](const void *p) { delete static_cast<const T*>(p); }, 0});
+        epoch.fetch_add(1, std::memory_order_seq_cst);
+
+        // Read sections are short, a few tries mostly free it right away
+        for (int i = 0; i < RetireSpins && !retired.isEmpty(); ++i) {
+            if (i) QThread::yieldCurrentThread();
+            reclaim();
+        }
+    }
+
+    //! Block until everything retired so far is freed. Readers must not wait for the caller.
+    void synchronize() {
+        // Flipped before each wait, so new readers count on the other counter and can't hold it up
+        for (int n = 0; n < 2 && !retired.isEmpty(); ++n) {
+            const int drained = epoch.fetch_add(1, std::memory_order_seq_cst) & 1;
+            while (readers[drained].count.load(std::memory_order_seq_cst) != 0)
+                QThread::yieldCurrentThread();
+            sweep(1 << drained);
+        }
+    }
+
+private:
+    static const int RetireSpins = 16;
+
+    void reclaim() {
+        // A reader that loaded a retired object counted itself before: seen at zero, it left
+        int idle = 0;
+        for (int i = 0; i < 2; ++i) {
+            if (readers[i].count.load(std::memory_order_seq_cst) == 0)
+                idle |= 1 << i;
+        }
+        sweep(idle);
+    }
+
+    // Mark \a idle counters seen at zero, free what both were seen at zero for
+    void sweep(int idle) {
+        QVector<Retired> done;
+        for (int i = 0; i < retired.size(); ) {
+            retired[i].seenIdle |= idle;
+            if (retired[i].seenIdle == 3)
+                done.append(retired.takeAt(i));
+            else
+                ++i;
+        }
+        // Out of the loop, a destructor may retire more
+        for (const auto &r : done)
+            r.destroy(r.object);
+    }
+
+    struct alignas(64) Counter
+    {
+        std::atomic<int> count{0};
+    };
+    mutable Counter readers[2];
+    std::atomic<int> epoch{0};
+
+    struct Retired
+    {
+        const void *object;
+        void (*destroy)(const void*);
+        int seenIdle;       // bit per counter seen at zero since it was retired
+    };
+    QVector<Retired> retired;   // writers only
+};
+
+//--------------------------------------------------------------------------------
+/*!
+ * \brief EpochPtr class is a pointer published to readers of an EpochDomain.
+ *        Owns the current object; replaced ones are retired to the domain.
+ */
+template<class T>
+class EpochPtr {
+public:
+    EpochPtr() = default;
+    ~EpochPtr() { delete ptr.load(std::memory_order_relaxed); }
+
+    EpochPtr(const EpochPtr&) = delete;
+    EpochPtr& operator=(const EpochPtr&) = delete;
+
+    //! Current object: readers hold a ReadGuard of its domain while using it, writers need none.
+    const T *load() const { return ptr.load(std::memory_order_seq_cst); }
+
+    //! Publish \a next (may be null) and retire the object it replaces.
+    void publish(EpochDomain &domain, const T *next) {
+        if (const T *old = ptr.exchange(next, std::memory_order_seq_cst))
+            domain.retire(old);
+    }
+
+private:
+    std::atomic<const T*> ptr{nullptr};
+};
+
+#endif // EPOCH_H
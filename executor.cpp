@@ -0,0 +1,272 @@
+#include "executor.h"
+#include <QMetaObject>
+#include <QThreadPool>
+#include <atomic>
+#include <deque>
+
+#ifdef Q_OS_LINUX
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+//--------------------------------------------------------------------------------
+
+void ObjectExecutor::post(std::function<void()> fn)
+{
+    if (context)
+        QMetaObject::invokeMethod(context, std::move(fn), Qt::QueuedConnection);
+}
+
+PoolExecutor::PoolExecutor(QThreadPool* pool)
+    : pool(pool ? pool : QThreadPool::globalInstance())
+{
+}
+
+void PoolExecutor::post(std::function<void()> fn)
+{
+    pool->start(std::move(fn));
+}
+
+//--------------------------------------------------------------------------------
+
+class WorkStealingExecutor::Worker : public QThread {
+public:
+    Worker(WorkStealingExecutor *pool, int index) : pool(pool), index(index) {}
+
+    void push(QRunnable *task)
+    {
+        QMutexLocker locker(&mutex);
+        tasks.push_back(task);
+        depth.fetchAndAddRelaxed(1);
+    }
+
+    void pushAll(const QList<QRunnable*> &list)
+    {
+        QMutexLocker locker(&mutex);
+        tasks.insert(tasks.end(), list.begin(), list.end());
+        depth.fetchAndAddRelaxed(list.size());
+    }
+
+    QRunnable *pop()
+    {
+        if (depth.loadRelaxed() == 0) return nullptr;
+
+        QMutexLocker locker(&mutex);
+        if (tasks.empty()) return nullptr;
+        QRunnable *task = tasks.front();
+        tasks.pop_front();
+        depth.fetchAndAddRelaxed(-1);
+        return task;
+    }
+
+    // Move the newer half of the deque to out
+    void stealHalf(QList<QRunnable*> &out)
+    {
+        if (depth.loadRelaxed() == 0) return;
+
+        QMutexLocker locker(&mutex);
+        const int count = int(tasks.size() + 1) / 2;
+        if (count == 0) return;
+        out.reserve(count);
+        for (auto it = tasks.end() - count; it != tasks.end(); ++it)
+            out.append(*it);
+        tasks.erase(tasks.end() - count, tasks.end());
+        depth.fetchAndAddRelaxed(-count);
+    }
+
+    WorkStealingExecutor *pool;
+    int index;
+
+    QMutex mutex;
+    std::deque<QRunnable*> tasks;
+    QAtomicInteger<qint64> depth{0};
+    QAtomicInteger<quint64> executed{0};
+    QAtomicInteger<quint64> steals{0};
+
+protected:
+    void run() override;
+};
+
+static void runTask(QRunnable *task)
+{
+    const bool autoDelete = task->autoDelete();
+    task->run();
+    if (autoDelete)
+        delete task;
+}
+
+void WorkStealingExecutor::Worker::run()
+{
+#ifdef Q_OS_LINUX
+    if (pool->pinThreads) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(index % QThread::idealThreadCount(), &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+#endif
+    while (true) {
+        if (QRunnable *task = pool->take(this)) {
+            runTask(task);
+            executed.fetchAndAddRelaxed(1);
+            continue;
+        }
+
+        // Announce idle, then look once more: a start() either sees us idle or we see its task
+        quint64 seen;
+        {
+            QMutexLocker locker(&pool->idleMutex);
+            seen = pool->epoch;
+        }
+        pool->idle.fetchAndAddOrdered(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        QRunnable *task = pool->take(this);
+        bool stop = false;
+        if (!task) {
+            QMutexLocker locker(&pool->idleMutex);
+            while (pool->epoch == seen && !pool->stopping)
+                pool->idleCond.wait(&pool->idleMutex);
+            stop = pool->stopping;
+        }
+        pool->idle.fetchAndAddOrdered(-1);
+
+        if (task) {
+            runTask(task);
+            executed.fetchAndAddRelaxed(1);
+        } else if (stop) {
+            while ((task = pool->take(this))) {
+                runTask(task);
+                executed.fetchAndAddRelaxed(1);
+            }
+            return;
+        }
+    }
+}
+
+//--------------------------------------------------------------------------------
+
+WorkStealingExecutor::WorkStealingExecutor(int threads, bool pinThreads)
+    : pinThreads(pinThreads)
+{
+    if (threads <= 0)
+        threads = QThread::idealThreadCount();
+
+    for (int i = 0; i < threads; ++i) {
+        auto *w = new Worker(this, i);
+        w->setObjectName(QStringLiteral("Worker %1").arg(i));
+        workers.append(w);
+    }
+    for (auto *w : workers)
+        w->start();
+}
+
+WorkStealingExecutor::~WorkStealingExecutor()
+{
+    {
+        QMutexLocker locker(&idleMutex);
+        stopping = true;
+        ++epoch;
+        idleCond.wakeAll();
+    }
+    for (auto *w : workers) {
+        w->wait();
+        delete w;
+    }
+}
+
+WorkStealingExecutor &WorkStealingExecutor::instance()
+{
+    static WorkStealingExecutor pool;
+    return pool;
+}
+
+void WorkStealingExecutor::start(QRunnable *task)
+{
+    target()->push(task);
+    wake(1);
+}
+
+void WorkStealingExecutor::start(const QList<QRunnable*> &tasks)
+{
+    if (tasks.isEmpty()) return;
+    target()->pushAll(tasks);
+    wake(tasks.size());
+}
+
+void WorkStealingExecutor::post(std::function<void()> fn)
+{
+    start(QRunnable::create(std::move(fn)));
+}
+
+WorkStealingExecutor::Worker *WorkStealingExecutor::target()
+{
+    // Own deque from a worker, keeps the task on a warm cache
+    auto *w = dynamic_cast<Worker*>(QThread::currentThread());
+    if (w && w->pool == this)
+        return w;
+    return workers.at(int(quint32(cursor.fetchAndAddRelaxed(1)) % quint32(workers.size())));
+}
+
+void WorkStealingExecutor::wake(int count)
+{
+    // Pairs with the worker's idle increment
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (idle.loadRelaxed() == 0) return;
+
+    QMutexLocker locker(&idleMutex);
+    ++epoch;
+    if (count > 1)
+        idleCond.wakeAll();
+    else
+        idleCond.wakeOne();
+}
+
+QRunnable *WorkStealingExecutor::take(Worker *w)
+{
+    if (QRunnable *task = w->pop())
+        return task;
+    return steal(w);
+}
+
+QRunnable *WorkStealingExecutor::steal(Worker *w)
+{
+    const int n = workers.size();
+    QList<QRunnable*> loot;
+
+    for (int k = 1; k < n && loot.isEmpty(); ++k)
+        workers.at((w->index + k) % n)->stealHalf(loot);
+    if (loot.isEmpty())
+        return nullptr;
+
+    w->steals.fetchAndAddRelaxed(1);
+    QRunnable *task = loot.takeFirst();
+    if (!loot.isEmpty())
+        w->pushAll(loot);
+    return task;
+}
+
+QVector<WorkStealingExecutor::WorkerStats> WorkStealingExecutor::stats() const
+{
+    QVector<WorkerStats> result;
+    result.reserve(workers.size());
+    for (auto *w : workers)
+        result.append(WorkerStats{ w->depth.loadRelaxed(), w->executed.loadRelaxed(), w->steals.loadRelaxed() });
+    return result;
+}
+
+qint64 WorkStealingExecutor::queueDepth() const
+{
+    qint64 depth = 0;
+    for (auto *w : workers)
+        depth += w->depth.loadRelaxed();
+    return depth;
+}
+
+quint64 WorkStealingExecutor::stealCount() const
+{
+    quint64 steals = 0;
+    for (auto *w : workers)
+        steals += w->steals.loadRelaxed();
+    return steals;
+}
@@ -0,0 +1,131 @@
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+
+#include <QObject>
+#include <QPointer>
+#include <QRunnable>
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QAtomicInteger>
+#include <QList>
+#include <QVector>
+#include <coroutine>
+#include <functional>
+
+class QThreadPool;
+
+//--------------------------------------------------------------------------------
+/*!
+ * \brief Executor class is where tasks are run and suspended coroutines resumed.
+ */
+class Executor {
+public:
+    virtual ~Executor() = default;
+    virtual void post(std::function<void()> fn) = 0;
+
+    struct ScheduleAwaiter
+    {
+        Executor* executor;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> h) { executor->post([h]() { h.resume(); }); }
+        void await_resume() const noexcept {}
+    };
+
+    //! co_await executor->schedule(): continue the coroutine on this executor.
+    ScheduleAwaiter schedule() { return ScheduleAwaiter{this}; }
+};
+
+/*!
+ * \brief ObjectExecutor class resumes coroutines in the thread of a QObject,
+ *        e.g. IoThread::context() to stay on a connection's I/O thread.
+ */
+class ObjectExecutor : public Executor {
+public:
+    explicit ObjectExecutor(QObject* context) : context(context) {}
+    void post(std::function<void()> fn) override;
+
+private:
+    QPointer<QObject> context;
+};
+
+/*!
+ * \brief PoolExecutor class resumes coroutines on a QThreadPool.
+ */
+class PoolExecutor : public Executor {
+public:
+    explicit PoolExecutor(QThreadPool* pool = nullptr);
+    void post(std::function<void()> fn) override;
+
+private:
+    QThreadPool* pool;
+};
+
+//--------------------------------------------------------------------------------
+/*!
+ * \brief WorkStealingExecutor class runs QRunnables on its own fixed set of
+ *        worker threads, apart from QThreadPool::globalInstance() and whatever
+ *        else (QtConcurrent) shares it.
+ *        Every worker has its own deque, there is no shared queue lock:
+ *        - a task started from a worker goes to that worker's deque,
+ *          from any other thread to the next deque round-robin;
+ *        - a worker runs its own deque in FIFO order, so a requeued task
+ *          goes behind the others;
+ *        - an idle worker steals half of another worker's deque, then parks.
+ *        Tasks are deleted after run() when autoDelete(), like QThreadPool.
+ */
+class WorkStealingExecutor : public Executor {
+public:
+    //! \a threads <= 0 use idealThreadCount(); \a pinThreads binds worker i to CPU i (Linux only).
+    explicit WorkStealingExecutor(int threads = 0, bool pinThreads = false);
+    //! Runs what is still queued, then joins the workers.
+    ~WorkStealingExecutor() override;
+
+    //! Shared instance (idealThreadCount() threads), default of ConnectionHandler.
+    static WorkStealingExecutor &instance();
+
+    void start(QRunnable *task);
+
+    //! Queue all tasks with one lock, parked workers are woken to steal their share.
+    void start(const QList<QRunnable*> &tasks);
+
+    void post(std::function<void()> fn) override;
+
+    int threadCount() const { return workers.size(); }
+
+    struct WorkerStats
+    {
+        qint64 queued;      //!< tasks in its deque now
+        quint64 executed;
+        quint64 steals;     //!< successful steals by this worker
+    };
+
+    QVector<WorkerStats> stats() const;
+
+    //! Tasks queued in all deques (not counting running ones).
+    qint64 queueDepth() const;
+    quint64 stealCount() const;
+
+private:
+    class Worker;
+
+    Worker *target();
+    void wake(int count);
+
+    // Next task for worker w: own deque first, then steal
+    QRunnable *take(Worker *w);
+    QRunnable *steal(Worker *w);
+
+    QList<Worker*> workers;
+    bool pinThreads;
+    QAtomicInt cursor{0};
+
+    // Parking of idle workers; epoch changes on every wake
+    QMutex idleMutex;
+    QWaitCondition idleCond;
+    QAtomicInt idle{0};
+    quint64 epoch = 0;
+    bool stopping = false;
+};
+
+#endif // EXECUTOR_H
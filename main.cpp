@@ -1,33 +1,116 @@
 #include <QCoreApplication>
-#include <QtConcurrent/QtConcurrent>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QQueue>
 
 #include "channel.h"
 
+//--------------------------------------------------------------------------------
+// Channel throughput benchmark: run with --bench-channel
+
+// Original Channel implementation (unbounded queue of void* behind a mutex), kept for comparison.
+class MutexChannel {
+public:
+    void send(void* value) {
+        QMutexLocker locker(&mutex);
+        queue.enqueue(value);
+        cond.wakeOne();
+    }
+
+    void* recv() {
+        QMutexLocker locker(&mutex);
+        while (queue.isEmpty()) {
+            cond.wait(&mutex);
+        }
+        return queue.dequeue();
+    }
+
+private:
+    QQueue<void*> queue;
+    QMutex mutex;
+    QWaitCondition cond;
+};
+
+template<class C, class M>
+static double benchChannel(C &chn, int producers, int perProducer, M (*make)(int))
+{
+    QList<QThread*> threads;
+    for (int p = 0; p < producers; ++p) {
+        threads.append(QThread::create([&chn, perProducer, make]() {
+            for (int i = 1; i <= perProducer; ++i)
+                chn.send(make(i));
+        }));
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    for (auto *t : threads) t->start();
+
+    const qint64 total = qint64(producers) * perProducer;
+    for (qint64 i = 0; i < total; ++i)
+        chn.recv();
+
+    const double secs = timer.nsecsElapsed() / 1e9;
+    for (auto *t : threads) { t->wait(); delete t; }
+    return total / secs;
+}
+
+static void benchChannels()
+{
+    const int perProducer = 1000000;
+    for (int producers : {1, 2, 4, 8}) {
+        MutexChannel mc;
+        Channel<quintptr> lc(4096);
+        double mutexRate = benchChannel(mc, producers, perProducer,
+                                        +[](int i) { return reinterpret_cast<void*>(quintptr(i)); });
+        double lockFreeRate = benchChannel(lc, producers, perProducer,
+                                           +[](int i) { return quintptr(i); });
+        qInfo().noquote() << QStringLiteral("producers %1: mutex %2 M msg/s, lock-free %3 M msg/s")
+                                 .arg(producers)
+                                 .arg(mutexRate / 1e6, 0, 'f', 2)
+                                 .arg(lockFreeRate / 1e6, 0, 'f', 2);
+    }
+}
+
+//--------------------------------------------------------------------------------
+
+static AsyncTask consume(Select<int, QString>& sel, Executor* executor)
+{
+    while (auto msg = co_await sel.next(executor)) {
+        if (msg->id == 9)
+            break;
+    }
+}
+
 int main(int argc, char *argv[])
 {
     QCoreApplication a(argc, argv);
 
-    Channel chn;
-    Channel ctx;
+    if (a.arguments().contains(QStringLiteral("--bench-channel"))) {
+        benchChannels();
+        return 0;
+    }
+
+    Channel<int> chn;
+    Channel<QString> ctx;
 
-    chn.send(new int(5));
+    chn.send(5);
 
-    Select sel({
+    Select<int, QString> sel({
         {1, &chn},
         {9, &ctx}
     });
 
-    auto f = QtConcurrent::run([&sel](){
-        sel.capture([](int i, void* val) -> int {
-            switch(i)
-            {
-            case 1:
-                return 0;
-            case 9:
-                return 1;
-            }
-            return 0;
-        });
+    // Ends the consumer loop on quit, no wake-up message needed
+    CancelToken stop;
+    sel.setCancelToken(&stop);
+
+    // Consumer runs in the main thread, suspended while there is nothing to read
+    ObjectExecutor executor(&a);
+    consume(sel, &executor);
+
+    QObject::connect(&a, &QCoreApplication::aboutToQuit, [&stop]() {
+        stop.cancel();
     });
 
     return a.exec();
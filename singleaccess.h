@@ -11,21 +11,52 @@
 #include <QWaitCondition>
 #include <QEventLoop>
 #include <QMap>
+#include <QHash>
 #include <QSet>
 #include <QAtomicInt>
 #include <QFile>
 #include <memory>
 #include <type_traits>
+#include <algorithm>
+#include <numeric>
 #include <QSqlDatabase>
 #include <QSqlQuery>
 #include <QSqlError>
 #include <QVariant>
 #include <QThreadStorage>
+#include <QThreadPool>
+#include <QSemaphore>
 #include <QVector>
+#include <QAtomicInteger>
+#include <QDebug>
+
+//--------------------------------------------------------------------------------
+// Told about entities released modified by SingleAccessWPtr (SingleAccessRepo write-behind)
+class SingleAccessDirtySink {
+public:
+    virtual ~SingleAccessDirtySink() = default;
+    virtual void MarkDirty(int id) = 0;
+};
 
 //--------------------------------------------------------------------------------
 class SingleAccess {
     QSharedPointer<QReadWriteLock> lock_;
+
+    // Bookkeeping of SingleAccessRepo
+    template<class> friend class SingleAccessRepo;
+    template<class> friend class SingleAccessWPtr;
+    QAtomicInt referenced_{1};              // CLOCK bit, set by every Get/GetW
+    QAtomicInteger<qint64> footprint_{0};   // size of the last loaded blob
+    qint64 charged_ = 0;                    // bytes counted against the budget
+    QAtomicInt dirty_{0};                   // modified since last stored
+    QAtomicPointer<SingleAccessDirtySink> sink_;
+    int id_ = 0;
+
+    // Called with the write lock still held; only the clean -> dirty transition is reported
+    void markDirty() {
+        if (dirty_.fetchAndStoreRelaxed(1)) return;
+        if (SingleAccessDirtySink* s = sink_.loadAcquire()) s->MarkDirty(id_);
+    }
 public:
     SingleAccess() : lock_(new QReadWriteLock) {}
     virtual ~SingleAccess() = default;
@@ -34,6 +65,9 @@ public:
 
     virtual QByteArray Serialize() const = 0;            // const
     virtual void Deserialize(const QByteArray&) = 0;     // const-ref
+
+    // Approximate bytes held, for the repo's memory budget (default: size of the stored blob)
+    virtual qint64 MemoryUsage() const { return footprint_.loadRelaxed(); }
 };
 
 //--------------------------------------------------------------------------------
@@ -98,6 +132,9 @@ public:
         , lock_(obj ? obj->Lock() : QSharedPointer<QReadWriteLock>())
         , locker_(lock_ ? std::make_unique<QWriteLocker>(lock_.data()) : nullptr) {}
 
+    // Releasing the guard marks the entity dirty (write-behind picks it up)
+    ~SingleAccessWPtr() { release(); }
+
     // Non-copyable (locker is non-copyable).
     SingleAccessWPtr(const SingleAccessWPtr&) = delete;
     SingleAccessWPtr& operator=(const SingleAccessWPtr&) = delete;
@@ -111,6 +148,7 @@ public:
     }
     SingleAccessWPtr& operator=(SingleAccessWPtr&& other) noexcept {
         if (this != &other) {
+            release();
             QPointer<T>::operator=(other.data());
             lock_   = std::move(other.lock_);
             locker_ = std::move(other.locker_);
@@ -118,6 +156,15 @@ public:
         }
         return *this;
     }
+
+private:
+    // Mark dirty before unlocking, so a flusher serializing under the read lock sees it
+    void release() {
+        if (!locker_) return;
+        if (T* obj = QPointer<T>::data())
+            obj->markDirty();
+        locker_.reset();
+    }
 };
 
 //--------------------------------------------------------------------------------
@@ -137,55 +184,95 @@ public:
 // ---- SQLite-backed SingleAccessRepo (C++17) ----
 
 template<class E>
-class SingleAccessRepo {
+class SingleAccessRepo : private SingleAccessDirtySink {
     static_assert(std::is_base_of_v<QObject, E>,      "E must inherit QObject");
     static_assert(std::is_base_of_v<SingleAccess, E>, "E must inherit SingleAccess");
 
-    // RAM-resident only
-    QMap<int, E*>   allEntity;
-    // ids currently being serialized (in-flight)
-    QSet<int>       swappingOut;
-
-    // Protects allEntity + swappingOut
-    QReadWriteLock  lock_;
-
-    // For wait/wake (in-flight swaps)
-    QMutex          inflightMx;
-    QWaitCondition  inflightCv;
+    // Resident index, lock-striped: an id always maps to the same shard, and ids of
+    // different shards share no lock, no in-flight set and no wait condition
+    struct alignas(64) Shard {
+        // RAM-resident only
+        QHash<int, E*>  entities;
+        // ids currently being serialized (in-flight)
+        QSet<int>       swappingOut;
+
+        // Protects entities + swappingOut
+        QReadWriteLock  lock;
+
+        // For wait/wake (in-flight swaps and flushes)
+        QMutex          inflightMx;
+        QWaitCondition  inflightCv;
+        QSet<int>       flushing;       // serialized, not committed yet (under inflightMx)
+    };
+
+    static const int ShardBits = 6;
+    static const int ShardCount = 1 << ShardBits;
+    Shard           shards[ShardCount];
+
+    // Fibonacci hashing, so runs of sequential ids spread over all shards
+    static int shardIndex(int id) { return int((quint32(id) * 2654435769u) >> (32 - ShardBits)); }
+    Shard& shardOf(int id) { return shards[shardIndex(id)]; }
+
+    // Budget (0 = unlimited) and what is resident now
+    QAtomicInt              maxEntities{0};
+    QAtomicInteger<qint64>  maxBytes{0};
+    QAtomicInt              residentCount{0};
+    QAtomicInteger<qint64>  residentBytes{0};
+    QAtomicInteger<quint64> evictions{0};
+
+    // Background evictor: at most one task per repo
+    QMutex          evictMx;
+    QWaitCondition  evictCv;
+    bool            evictRunning = false;
+    bool            evictAgain = false;
+    bool            stopping = false;
+    int             clockHand = 0;      // shard swept next, evictor only
+
+    // Evicting stops at EvictTarget percent of the budget
+    static const int EvictTarget = 90;
+
+    // Final flush at stop: rounds retried for ids still dirty, and the pause between them
+    static const int FinalRetries = 3;
+    static const int FinalRetryMs = 100;
+
+    // Write-behind: ids released dirty, written by flushThread in grouped transactions
+    QMutex          dirtyMx;
+    QWaitCondition  dirtyCv;
+    QVector<int>    dirtyIds;
+    QThread*        flushThread = nullptr;
+    bool            flushStop = false;
+    int             flushIntervalMs = 0;
+    int             flushBatch = 512;
+    QAtomicInt      writeBehind{0};
 
     // DB bits
-    QByteArray      name;           // table name (sanitized)
+    QByteArray      name;           // table name as given
+    QString         table;          // sanitized once: [A-Za-z0-9_]+
     QString         dbPath;         // sqlite filename (e.g. "/var/lib/mydb.sqlite3")
-
-    // Per-thread connection factory
-    QSqlDatabase dbForThread() {
-        // One connection per thread; connection names must be unique per thread.
-        static QThreadStorage<QString> tlsConnName;
-        if (!tlsConnName.hasLocalData()) {
-            QString conn = QStringLiteral("repo_%1_%2")
-                               .arg(reinterpret_cast<qulonglong>(this), 0, 16)
-                               .arg(reinterpret_cast<qulonglong>(QThread::currentThreadId()), 0, 16);
-            QSqlDatabase db = QSqlDatabase::addDatabase(QStringLiteral("QSQLITE"), conn);
-            db.setDatabaseName(dbPath);
-            if (!db.open()) {
-                // You may want to handle or log db.lastError() here.
-            } else {
-                // Pragmas for read-mostly + decent concurrency
-                QSqlQuery q(db);
-                q.exec(QStringLiteral("PRAGMA journal_mode=WAL;"));
-                q.exec(QStringLiteral("PRAGMA synchronous=NORMAL;"));
-                q.exec(QStringLiteral("PRAGMA temp_store=MEMORY;"));
-                q.exec(QStringLiteral("PRAGMA mmap_size=268435456;")); // 256 MB, adjust as needed
-                q.exec(QStringLiteral("PRAGMA page_size=4096;"));      // match FS, adjust if you init DB fresh
-            }
-            tlsConnName.setLocalData(conn);
-        }
-        return QSqlDatabase::database(tlsConnName.localData());
+    quint64         serial;         // tells repos apart in per-thread state, never reused
+
+    // Table is created by the first connection that needs it, once per repo
+    QMutex          schemaMx;
+    QAtomicInt      tableReady{0};
+
+    // Per-thread connection with its statements, prepared once and rebound per call
+    struct ThreadDb {
+        QSqlDatabase db;
+        QSqlQuery    load;          // SELECT raw WHERE Id=?
+        QSqlQuery    loadChunk;     // SELECT Id, raw WHERE Id IN (InChunk x ?)
+        QSqlQuery    upsert;
+        QSqlQuery    remove;
+        bool         prepared = false;
+        bool         chunkPrepared = false;
+    };
+
+    static quint64 nextSerial() {
+        static QAtomicInteger<quint64> counter{0};
+        return counter.fetchAndAddRelaxed(1) + 1;
     }
 
-    QString tableName() const {
+    static QString sanitize(const QByteArray& src) {
         // sanitize name -> [A-Za-z0-9_]+
-        QByteArray src = name;
         QByteArray out;
         out.reserve(src.size());
         for (char c : src) {
@@ -198,102 +285,605 @@ class SingleAccessRepo {
         return QString::fromUtf8(out);
     }
 
-    bool ensureTable() {
-        QSqlDatabase db = dbForThread();
-        if (!db.isOpen()) return false;
+    // Keyed by repo serial: a thread using two repos (same E or not) gets two connections
+    static QHash<quint64, QSharedPointer<ThreadDb>>& threadDbs() {
+        static QThreadStorage<QHash<quint64, QSharedPointer<ThreadDb>>> tls;
+        return tls.localData();
+    }
+
+    // Connection of this thread with table and statements ready; nullptr if the DB can't be used
+    ThreadDb* threadDb() {
+        QSharedPointer<ThreadDb>& slot = threadDbs()[serial];
+        if (!slot) {
+            // One connection per thread and repo; connection names must be unique.
+            slot.reset(new ThreadDb);
+            const QString conn = QStringLiteral("repo_%1_%2")
+                                     .arg(serial)
+                                     .arg(reinterpret_cast<qulonglong>(QThread::currentThreadId()), 0, 16);
+            slot->db = QSqlDatabase::addDatabase(QStringLiteral("QSQLITE"), conn);
+            slot->db.setDatabaseName(dbPath);
+            if (!slot->db.open()) {
+                // You may want to handle or log db.lastError() here.
+            } else {
+                // Pragmas for read-mostly + decent concurrency
+                QSqlQuery q(slot->db);
+                q.exec(QStringLiteral("PRAGMA journal_mode=WAL;"));
+                q.exec(QStringLiteral("PRAGMA synchronous=NORMAL;"));
+                q.exec(QStringLiteral("PRAGMA temp_store=MEMORY;"));
+                q.exec(QStringLiteral("PRAGMA mmap_size=268435456;")); // 256 MB, adjust as needed
+                q.exec(QStringLiteral("PRAGMA page_size=4096;"));      // match FS, adjust if you init DB fresh
+            }
+        }
+        ThreadDb* t = slot.data();
+        if (t->prepared) return t;
+        if (!t->db.isOpen() || !ensureTable(t->db)) return nullptr;
+
+        t->load = QSqlQuery(t->db);
+        t->load.setForwardOnly(true);
+        t->upsert = QSqlQuery(t->db);
+        t->remove = QSqlQuery(t->db);
+        t->loadChunk = QSqlQuery(t->db);
+        t->loadChunk.setForwardOnly(true);
+        t->prepared =
+            t->load.prepare(QStringLiteral("SELECT raw FROM %1 WHERE Id=?").arg(table)) &&
+            t->upsert.prepare(QStringLiteral("INSERT OR REPLACE INTO %1(Id,raw) VALUES(?,?)").arg(table)) &&
+            t->remove.prepare(QStringLiteral("DELETE FROM %1 WHERE Id=?").arg(table));
+        return t->prepared ? t : nullptr;
+    }
+
+    // Drop this thread's connection. The flush thread and the evictor drop theirs when done;
+    // the destructor drops the destroying thread's, other caller threads keep theirs.
+    void releaseThreadDb() {
+        QSharedPointer<ThreadDb> t = threadDbs().take(serial);
+        if (!t) return;
+        const QString conn = t->db.connectionName();
+        t.reset();      // queries and handle first, removeDatabase() wants them gone
+        QSqlDatabase::removeDatabase(conn);
+    }
+
+    bool ensureTable(QSqlDatabase& db) {
+        if (tableReady.loadAcquire()) return true;
+        QMutexLocker g(&schemaMx);
+        if (tableReady.loadRelaxed()) return true;
         QSqlQuery q(db);
         const QString sql =
             QStringLiteral("CREATE TABLE IF NOT EXISTS %1("
                            "Id INTEGER PRIMARY KEY, "
-                           "raw BLOB NOT NULL)").arg(tableName());
-        return q.exec(sql);
+                           "raw BLOB NOT NULL)").arg(table);
+        if (!q.exec(sql)) return false;
+        tableReady.storeRelease(1);
+        return true;
+    }
+
+    // Recency: one relaxed store, skipped when already set, so readers don't bounce a line
+    static E* touch(E* e) {
+        if (!e->referenced_.loadRelaxed()) e->referenced_.storeRelaxed(1);
+        return e;
+    }
+
+    static void load(E* e, const QByteArray& raw) {
+        e->Deserialize(raw);
+        e->footprint_.storeRelaxed(raw.size());
+    }
+
+    // Budget accounting where a shard's entities change (its write lock held)
+    void charge(int id, E* e) {
+        e->id_ = id;
+        e->sink_.storeRelease(this);
+        e->charged_ = qMax<qint64>(e->MemoryUsage(), qint64(sizeof(E)));
+        residentBytes.fetchAndAddRelaxed(e->charged_);
+        residentCount.fetchAndAddRelaxed(1);
+    }
+    void uncharge(E* e) {
+        residentBytes.fetchAndAddRelaxed(-e->charged_);
+        residentCount.fetchAndAddRelaxed(-1);
+    }
+
+    // Above budget (percent 100) or above the eviction target (EvictTarget)
+    bool overBudget(int percent = 100) const {
+        const int maxN = maxEntities.loadRelaxed();
+        const qint64 maxB = maxBytes.loadRelaxed();
+        return (maxN > 0 && qint64(residentCount.loadRelaxed()) * 100 > qint64(maxN) * percent) ||
+               (maxB > 0 && residentBytes.loadRelaxed() * 100 > maxB * percent);
+    }
+
+    // Start the background evictor when over budget (after an insert)
+    void maybeEvict() {
+        if (!overBudget()) return;
+        QMutexLocker g(&evictMx);
+        if (evictRunning) { evictAgain = true; return; }
+        if (stopping) return;
+        evictRunning = true;
+        QThreadPool::globalInstance()->start([this] { runEvictor(); });
+    }
+
+    void runEvictor() {
+        for (;;) {
+            evict();
+            QMutexLocker g(&evictMx);
+            if (!evictAgain || stopping) {
+                // Pool threads outlive the repo; don't leave its connection (and the file) open there.
+                // Once per run, so its rounds share the cached statements; and before evictRunning
+                // clears, as the destructor may run right after
+                releaseThreadDb();
+                evictRunning = false;
+                evictCv.wakeAll();
+                return;
+            }
+            evictAgain = false;
+        }
+    }
+
+    // CLOCK sweep, one shard per round: a set bit is cleared (second chance), a clear one is
+    // cold and swapped out. Two revolutions without an eviction mean all cold ones are guarded.
+    void evict() {
+        int idle = 0;
+        while (overBudget(EvictTarget) && idle < 2 * ShardCount) {
+            Shard& s = shards[clockHand];
+            clockHand = (clockHand + 1) % ShardCount;
+
+            QVector<int> victims;
+            {
+                QReadLocker mapR(&s.lock);
+                for (typename QHash<int,E*>::const_iterator it = s.entities.constBegin(); it != s.entities.constEnd(); ++it) {
+                    E* e = it.value();
+                    if (e->referenced_.loadRelaxed()) e->referenced_.storeRelaxed(0);
+                    else victims.push_back(it.key());
+                }
+            }
+
+            int evicted = 0;
+            for (int id : victims) {
+                {
+                    QMutexLocker g(&evictMx);
+                    if (stopping) return;
+                }
+                if (!overBudget(EvictTarget)) break;
+                if (swapOutIfIdle(id)) ++evicted;
+            }
+            idle = evicted ? 0 : idle + 1;    // next insert retries when we give up
+        }
+    }
+
+    // SwapOut for the evictor: skips entities touched since the sweep or held by a guard
+    bool swapOutIfIdle(int id) {
+        Shard& s = shardOf(id);
+        E* e = nullptr;
+        QSharedPointer<QReadWriteLock> elock;
+        {
+            QWriteLocker mapW(&s.lock);
+            typename QHash<int,E*>::iterator it = s.entities.find(id);
+            if (it == s.entities.end()) return false;
+
+            e = it.value();
+            if (e->referenced_.loadRelaxed()) return false;
+            elock = e->Lock();
+            if (!elock->tryLockForWrite()) return false;
+
+            s.entities.erase(it);
+            uncharge(e);
+            s.swappingOut.insert(id);
+        }
+        completeSwapOut(id, e);
+        elock->unlock();
+        evictions.fetchAndAddRelaxed(1);
+        return true;
+    }
+
+    // Tail of a swap out, entity write lock held: store, delete RAM copy, wake waiters
+    void completeSwapOut(int id, E* e) {
+        // A flush of this id in flight must land first; one that failed set dirty_ again,
+        // so it is read only now. Clean entities are already stored
+        waitWhileFlushing(id);
+        e->sink_.storeRelease(nullptr);
+        if (e->dirty_.fetchAndStoreRelaxed(0)) {
+            const QByteArray raw = e->Serialize();
+            (void)dbUpsert(id, raw);      // best effort; handle failure per your policy
+        }
+
+        // Delete in object's thread
+        QMetaObject::invokeMethod(e, [e]{ e->deleteLater(); }, Qt::QueuedConnection);
+
+        // Flip state, wake waiters
+        Shard& s = shardOf(id);
+        {
+            QWriteLocker mapW(&s.lock);
+            s.swappingOut.remove(id);
+        }
+        {
+            QMutexLocker g(&s.inflightMx);
+            s.inflightCv.wakeAll();
+        }
+    }
+
+    // SingleAccessDirtySink, called by a releasing SingleAccessWPtr
+    void MarkDirty(int id) override {
+        if (!writeBehind.loadRelaxed()) return;     // stored at SwapOut only
+        QMutexLocker g(&dirtyMx);
+        dirtyIds.push_back(id);
+        if (dirtyIds.size() >= flushBatch) dirtyCv.wakeOne();
+    }
+
+    void flushLoop() {
+        QMutexLocker g(&dirtyMx);
+        int finalRounds = 0;
+        for (;;) {
+            if (!flushStop && dirtyIds.size() < flushBatch)
+                dirtyCv.wait(&dirtyMx, flushIntervalMs);
+            QVector<int> ids;
+            ids.swap(dirtyIds);
+            const bool stop = flushStop;
+            g.unlock();
+            if (!ids.isEmpty()) flushDirty(ids);
+            g.relock();
+            if (!stop) continue;
+            if (dirtyIds.isEmpty()) break;    // final round done
+
+            // Guarded or failing ids: a few more tries, then give up (they stay dirty, SwapOut stores them)
+            if (++finalRounds > FinalRetries) {
+                qWarning() << "SingleAccessRepo" << table << ":" << dirtyIds.size()
+                           << "dirty entities left unflushed at stop";
+                break;
+            }
+            dirtyCv.wait(&dirtyMx, FinalRetryMs);
+        }
+        g.unlock();
+        releaseThreadDb();
+    }
+
+    // Serialize dirty entities under their read lock, write them flushBatch rows per transaction
+    void flushDirty(const QVector<int>& ids) {
+        int batch;
+        {
+            QMutexLocker g(&dirtyMx);
+            batch = flushBatch;
+        }
+        QVector<int> retry;
+        for (int from = 0; from < ids.size(); from += batch) {
+            const int to = qMin(from + batch, int(ids.size()));
+            QVector<QPair<int, QByteArray>> rows;
+            QVector<E*> flushed;    // kept alive while their ids are in flushing
+            rows.reserve(to - from);
+            flushed.reserve(to - from);
+
+            for (int i = from; i < to; ++i) {
+                const int id = ids[i];
+                Shard& s = shardOf(id);
+                QSharedPointer<QReadWriteLock> elock;
+                E* e = nullptr;
+                {
+                    QReadLocker mapR(&s.lock);
+                    typename QHash<int,E*>::const_iterator it = s.entities.constFind(id);
+                    if (it == s.entities.constEnd()) continue;   // swapped out or removed, stored by them
+                    e = it.value();
+                    if (!e->dirty_.loadRelaxed()) continue;     // duplicate, already flushed
+                    elock = e->Lock();
+                    // Taken under the map lock, so SwapOut can't delete it meanwhile
+                    if (!elock->tryLockForRead()) { retry.push_back(id); continue; }
+                }
+                e->dirty_.storeRelaxed(0);
+                rows.append(qMakePair(id, e->Serialize()));
+                flushed.append(e);
+                {
+                    QMutexLocker g(&s.inflightMx);
+                    s.flushing.insert(id);
+                }
+                elock->unlock();
+            }
+            if (rows.isEmpty()) continue;
+
+            if (!dbUpsertMany(rows)) {
+                // Keep them dirty for the next round, or for a SwapOut waiting on them
+                for (int k = 0; k < rows.size(); ++k) {
+                    flushed[k]->dirty_.storeRelaxed(1);
+                    retry.push_back(rows[k].first);
+                }
+            }
+            for (const auto& row : rows) {
+                Shard& s = shardOf(row.first);
+                QMutexLocker g(&s.inflightMx);
+                s.flushing.remove(row.first);
+                s.inflightCv.wakeAll();
+            }
+        }
+
+        if (!retry.isEmpty()) {
+            QMutexLocker g(&dirtyMx);
+            dirtyIds += retry;
+        }
+    }
+
+    void waitWhileFlushing(int id) {
+        Shard& s = shardOf(id);
+        QMutexLocker g(&s.inflightMx);
+        while (s.flushing.contains(id))
+            s.inflightCv.wait(&s.inflightMx, 10);
+    }
+
+    void stopFlusher() {
+        QThread* t;
+        {
+            QMutexLocker g(&dirtyMx);
+            t = flushThread;
+            flushThread = nullptr;
+            flushStop = true;
+            dirtyCv.wakeAll();
+        }
+        if (t) {
+            t->wait();
+            delete t;
+        }
+        writeBehind.storeRelaxed(0);
+    }
+
+    // SwapInMany: ids per IN (...) query (below SQLite's bound parameter limit),
+    // and fewest entities per deserializing thread
+    static const int InChunk = 500;
+    static const int ParallelMin = 64;
+
+    QString inQuery(int n) const {
+        QString sql = QStringLiteral("SELECT Id, raw FROM %1 WHERE Id IN (?").arg(table);
+        for (int i = 1; i < n; ++i) sql += QStringLiteral(",?");
+        sql += QLatin1Char(')');
+        return sql;
+    }
+
+    // Deserialize es[i] from raws[i] on pool threads and this one; a part no pool thread
+    // is free for runs here, so a caller on a busy pool can't deadlock
+    static void deserializeParallel(const QVector<E*>& es, const QVector<QByteArray>& raws) {
+        const int n = es.size();
+        const int parts = qBound(1, n / ParallelMin, qMax(QThread::idealThreadCount(), 1));
+        auto work = [&es, &raws, n, parts](int part) {
+            for (int i = int(qint64(part) * n / parts); i < int(qint64(part + 1) * n / parts); ++i)
+                load(es[i], raws[i]);
+        };
+
+        QSemaphore done;
+        int started = 0;
+        for (int part = 1; part < parts; ++part) {
+            if (QThreadPool::globalInstance()->tryStart([&work, &done, part] { work(part); done.release(); }))
+                ++started;
+            else
+                work(part);
+        }
+        work(0);
+        done.acquire(started);
+    }
+
+    // f(shard, id) for ids sorted by shard, each shard's read lock taken once
+    template<class F>
+    void scanByShard(const QVector<int>& sorted, F f) {
+        for (int k = 0; k < sorted.size(); ) {
+            const int shard = shardIndex(sorted[k]);
+            Shard& s = shards[shard];
+            QReadLocker mapR(&s.lock);
+            for (; k < sorted.size() && shardIndex(sorted[k]) == shard; ++k)
+                f(std::as_const(s), sorted[k]);
+        }
     }
 
     // Wait until 'id' is no longer in swappingOut
     void waitWhileSwapping(int id) {
+        Shard& s = shardOf(id);
         for (;;) {
             {
-                QReadLocker r(&lock_);
-                if (!swappingOut.contains(id)) break;
+                QReadLocker r(&s.lock);
+                if (!s.swappingOut.contains(id)) break;
             }
-            QMutexLocker g(&inflightMx);
-            inflightCv.wait(&inflightMx, 10);
+            QMutexLocker g(&s.inflightMx);
+            s.inflightCv.wait(&s.inflightMx, 10);
         }
     }
 
-    // Load raw blob for id from SQLite; returns false if not found or error
+    // Wait until no swap or flush of the shard is in flight (Clear/ClearAndWait)
+    static void waitShardIdle(Shard& s) {
+        for (;;) {
+            {
+                QReadLocker r(&s.lock);
+                if (s.swappingOut.isEmpty()) break;
+            }
+            QMutexLocker g(&s.inflightMx);
+            s.inflightCv.wait(&s.inflightMx, 10);
+        }
+        QMutexLocker g(&s.inflightMx);
+        while (!s.flushing.isEmpty())
+            s.inflightCv.wait(&s.inflightMx, 10);
+    }
+
+    // Empty every shard, returning what was resident with its lock (Clear/ClearAndWait)
+    QList< QPair<E*, QSharedPointer<QReadWriteLock> > > takeAll() {
+        QList< QPair<E*, QSharedPointer<QReadWriteLock> > > snapshot;
+        for (Shard& s : shards) {
+            QWriteLocker mapW(&s.lock);
+            qint64 bytes = 0;
+            for (typename QHash<int,E*>::const_iterator it = s.entities.constBegin(); it != s.entities.constEnd(); ++it) {
+                snapshot.append(qMakePair(it.value(), it.value()->Lock()));
+                bytes += it.value()->charged_;
+            }
+            residentCount.fetchAndAddRelaxed(-int(s.entities.size()));
+            residentBytes.fetchAndAddRelaxed(-bytes);
+            s.entities.clear();
+        }
+        return snapshot;
+    }
+
+    // Before deleting what takeAll() returned: wait out guards, and flushes that still use an entity.
+    // A flush registers its ids under the entity read lock, so write-locking each one comes first.
+    void waitUnused(const QList< QPair<E*, QSharedPointer<QReadWriteLock> > >& taken) {
+        for (int i = 0; i < taken.size(); ++i) {
+            QWriteLocker entityW(taken[i].second.data());
+        }
+        for (Shard& s : shards)
+            waitShardIdle(s);
+    }
+
+    // Load raw blob for id from SQLite; returns false if not found or error.
+    // One step of the cached statement, finish() resets it for the next call.
     bool dbLoad(int id, QByteArray &outRaw) {
-        if (!ensureTable()) return false;
-        QSqlDatabase db = dbForThread();
-        QSqlQuery q(db);
-        const QString sql = QStringLiteral("SELECT raw FROM %1 WHERE Id=?").arg(tableName());
-        if (!q.prepare(sql)) return false;
-        q.addBindValue(id);
+        ThreadDb* t = threadDb();
+        if (!t) return false;
+        QSqlQuery& q = t->load;
+        q.bindValue(0, id);
         if (!q.exec()) return false;
-        if (!q.next()) return false;
-        outRaw = q.value(0).toByteArray();
-        return true;
+        const bool found = q.next();
+        if (found) outRaw = q.value(0).toByteArray();
+        q.finish();
+        return found;
     }
 
     // Upsert raw blob for id into SQLite (used by SwapOut and/or snapshots)
     bool dbUpsert(int id, const QByteArray &raw) {
-        if (!ensureTable()) return false;
-        QSqlDatabase db = dbForThread();
-        QSqlQuery q(db);
-        const QString sql = QStringLiteral("INSERT OR REPLACE INTO %1(Id,raw) VALUES(?,?)")
-                                .arg(tableName());
-        if (!q.prepare(sql)) return false;
-        q.addBindValue(id);
-        q.addBindValue(raw);
-        return q.exec();
+        ThreadDb* t = threadDb();
+        if (!t) return false;
+        t->upsert.bindValue(0, id);
+        t->upsert.bindValue(1, raw);
+        return t->upsert.exec();
+    }
+
+    // Upsert many rows in one transaction with the cached statement
+    bool dbUpsertMany(const QVector<QPair<int, QByteArray>>& rows) {
+        ThreadDb* t = threadDb();
+        if (!t || !t->db.transaction()) return false;
+        bool ok = true;
+        for (int i = 0; ok && i < rows.size(); ++i) {
+            t->upsert.bindValue(0, rows[i].first);
+            t->upsert.bindValue(1, rows[i].second);
+            ok = t->upsert.exec();
+        }
+        if (ok) return t->db.commit();
+        t->db.rollback();
+        return false;
     }
 
     // Delete row for id from SQLite
     bool dbDelete(int id) {
-        if (!ensureTable()) return false;
-        QSqlDatabase db = dbForThread();
-        QSqlQuery q(db);
-        const QString sql = QStringLiteral("DELETE FROM %1 WHERE Id=?").arg(tableName());
-        if (!q.prepare(sql)) return false;
-        q.addBindValue(id);
-        return q.exec();
+        ThreadDb* t = threadDb();
+        if (!t) return false;
+        t->remove.bindValue(0, id);
+        return t->remove.exec();
     }
 
     // Bulk purge table (used by Clear/ClearAndWait)
     bool dbDeleteAll() {
-        if (!ensureTable()) return false;
-        QSqlDatabase db = dbForThread();
-        QSqlQuery q(db);
-        const QString sql = QStringLiteral("DELETE FROM %1").arg(tableName());
-        return q.exec(sql);
+        ThreadDb* t = threadDb();
+        if (!t) return false;
+        QSqlQuery q(t->db);
+        return q.exec(QStringLiteral("DELETE FROM %1").arg(table));
     }
 
 public:
     explicit SingleAccessRepo(QByteArray tableNameUtf8, const QString& sqlitePath)
-        : name(std::move(tableNameUtf8)), dbPath(sqlitePath) {}
+        : name(std::move(tableNameUtf8)), table(sanitize(name)), dbPath(sqlitePath)
+        , serial(nextSerial()) {}
+
+    ~SingleAccessRepo() {
+        // Write what is dirty, then let a running eviction round finish; both use this repo
+        stopFlusher();
+        {
+            QMutexLocker g(&evictMx);
+            stopping = true;
+            while (evictRunning)
+                evictCv.wait(&evictMx);
+        }
+        for (Shard& s : shards) {
+            QWriteLocker mapW(&s.lock);
+            for (E* e : std::as_const(s.entities))
+                e->sink_.storeRelease(nullptr);
+        }
+        releaseThreadDb();
+    }
+
+    // --- Write-behind ---
+    // Released SingleAccessWPtr mark their entity dirty; a dedicated DB thread writes dirty entities
+    // every intervalMs (or once batchSize are waiting), batchSize rows per transaction.
+    // SwapOut then only serializes entities still dirty. intervalMs 0 turns it off (after a final flush).
+    void SetWriteBehind(int intervalMs, int batchSize = 512) {
+        if (intervalMs <= 0) {
+            stopFlusher();
+            return;
+        }
+        QMutexLocker g(&dirtyMx);
+        flushIntervalMs = intervalMs;
+        flushBatch = qMax(batchSize, 1);
+        if (flushThread) return;
+
+        flushStop = false;
+        writeBehind.storeRelaxed(1);
+        flushThread = QThread::create([this] { flushLoop(); });
+        flushThread->setObjectName(QStringLiteral("repo-flush"));
+        flushThread->start();
+        g.unlock();
+
+        // Entities already dirty reported nothing (only clean -> dirty is); queue them now.
+        // Dirtied from here on are reported, duplicates are skipped by the flusher.
+        QVector<int> ids;
+        for (Shard& s : shards) {
+            QReadLocker mapR(&s.lock);
+            for (typename QHash<int,E*>::const_iterator it = s.entities.constBegin(); it != s.entities.constEnd(); ++it) {
+                if (it.value()->dirty_.loadRelaxed()) ids.push_back(it.key());
+            }
+        }
+        if (ids.isEmpty()) return;
+        g.relock();
+        dirtyIds += ids;
+        dirtyCv.wakeOne();
+    }
+
+    // Write every dirty entity now, on the calling thread.
+    void Flush() {
+        QVector<int> ids;
+        {
+            QMutexLocker g(&dirtyMx);
+            ids.swap(dirtyIds);
+        }
+        if (!ids.isEmpty()) flushDirty(ids);
+    }
+
+    int DirtyCount() {
+        QMutexLocker g(&dirtyMx);
+        return dirtyIds.size();
+    }
+
+    // --- Resident budget ---
+    // Keep at most maxCount entities / about maxMemory bytes (MemoryUsage()) in RAM, 0 = no limit.
+    // Past it, cold entities (CLOCK order) are swapped out in the background; guarded ones are skipped.
+    void SetBudget(int maxCount, qint64 maxMemory = 0) {
+        maxEntities.storeRelaxed(qMax(maxCount, 0));
+        maxBytes.storeRelaxed(qMax<qint64>(maxMemory, 0));
+        maybeEvict();
+    }
+
+    int ResidentCount() const { return residentCount.loadRelaxed(); }
+    qint64 ResidentBytes() const { return residentBytes.loadRelaxed(); }
+    quint64 Evictions() const { return evictions.loadRelaxed(); }
 
     int Count() {
-        QReadLocker _(&lock_);
-        return allEntity.count() + swappingOut.count();
+        int n = 0;
+        for (Shard& s : shards) {
+            QReadLocker _(&s.lock);
+            n += int(s.entities.size() + s.swappingOut.size());
+        }
+        return n;
     }
 
     // --- Read guard ---
     SingleAccessPtr<E> Get(int id) {
+        Shard& s = shardOf(id);
         // 1) RAM hit?
         {
-            QReadLocker mapR(&lock_);
-            typename QMap<int,E*>::const_iterator it = allEntity.find(id);
-            if (it != allEntity.end())
-                return SingleAccessPtr<E>(it.value());
+            QReadLocker mapR(&s.lock);
+            typename QHash<int,E*>::const_iterator it = s.entities.constFind(id);
+            if (it != s.entities.constEnd())
+                return SingleAccessPtr<E>(touch(it.value()));
         }
 
         // 2) If mid-swap, wait and retry RAM
         waitWhileSwapping(id);
         {
-            QReadLocker mapR(&lock_);
-            typename QMap<int,E*>::const_iterator it = allEntity.find(id);
-            if (it != allEntity.end())
-                return SingleAccessPtr<E>(it.value());
+            QReadLocker mapR(&s.lock);
+            typename QHash<int,E*>::const_iterator it = s.entities.constFind(id);
+            if (it != s.entities.constEnd())
+                return SingleAccessPtr<E>(touch(it.value()));
         }
 
         // 3) Try DB
@@ -304,49 +894,54 @@ public:
 
         // 4) Materialize and insert
         std::unique_ptr<E> fresh(new E);
-        fresh->Deserialize(raw);
+        load(fresh.get(), raw);
         E* e = fresh.release();
         {
-            QWriteLocker mapW(&lock_);
-            typename QMap<int,E*>::iterator it = allEntity.find(id);
-            if (it != allEntity.end()) { delete e; return SingleAccessPtr<E>(it.value()); }
-            allEntity.insert(id, e);
+            QWriteLocker mapW(&s.lock);
+            typename QHash<int,E*>::iterator it = s.entities.find(id);
+            if (it != s.entities.end()) { delete e; return SingleAccessPtr<E>(touch(it.value())); }
+            s.entities.insert(id, e);
+            charge(id, e);
         }
+        maybeEvict();
         return SingleAccessPtr<E>(e);
     }
 
     // --- Write guard ---
     SingleAccessWPtr<E> GetW(int id) {
+        Shard& s = shardOf(id);
         // 1) RAM hit?
         {
-            QReadLocker mapR(&lock_);
-            typename QMap<int,E*>::const_iterator it = allEntity.find(id);
-            if (it != allEntity.end())
-                return SingleAccessWPtr<E>(it.value());
+            QReadLocker mapR(&s.lock);
+            typename QHash<int,E*>::const_iterator it = s.entities.constFind(id);
+            if (it != s.entities.constEnd())
+                return SingleAccessWPtr<E>(touch(it.value()));
         }
 
         // 2) If mid-swap, wait and retry RAM
         waitWhileSwapping(id);
         {
-            QReadLocker mapR(&lock_);
-            typename QMap<int,E*>::const_iterator it = allEntity.find(id);
-            if (it != allEntity.end())
-                return SingleAccessWPtr<E>(it.value());
+            QReadLocker mapR(&s.lock);
+            typename QHash<int,E*>::const_iterator it = s.entities.constFind(id);
+            if (it != s.entities.constEnd())
+                return SingleAccessWPtr<E>(touch(it.value()));
         }
 
         // 3) Prefer DB row if present; else create empty
         QByteArray raw;
         std::unique_ptr<E> fresh(new E);
         if (dbLoad(id, raw)) {
-            fresh->Deserialize(raw);
+            load(fresh.get(), raw);
         }
         E* e = fresh.release();
         {
-            QWriteLocker mapW(&lock_);
-            typename QMap<int,E*>::iterator it = allEntity.find(id);
-            if (it != allEntity.end()) { delete e; return SingleAccessWPtr<E>(it.value()); }
-            allEntity.insert(id, e);
+            QWriteLocker mapW(&s.lock);
+            typename QHash<int,E*>::iterator it = s.entities.find(id);
+            if (it != s.entities.end()) { delete e; return SingleAccessWPtr<E>(touch(it.value())); }
+            s.entities.insert(id, e);
+            charge(id, e);
         }
+        maybeEvict();
         return SingleAccessWPtr<E>(e);
     }
 
@@ -354,21 +949,22 @@ public:
     SingleAccessWPtr<E> Create(int id,
                                QThread* targetThread = QThread::currentThread(),
                                QObject* parentForEntity = nullptr) {
+        Shard& s = shardOf(id);
         // RAM?
         {
-            QReadLocker mapR(&lock_);
-            typename QMap<int,E*>::const_iterator it = allEntity.find(id);
-            if (it != allEntity.end())
-                return SingleAccessWPtr<E>(it.value());
+            QReadLocker mapR(&s.lock);
+            typename QHash<int,E*>::const_iterator it = s.entities.constFind(id);
+            if (it != s.entities.constEnd())
+                return SingleAccessWPtr<E>(touch(it.value()));
         }
 
         // If mid-swap, wait & retry RAM
         waitWhileSwapping(id);
         {
-            QReadLocker mapR(&lock_);
-            typename QMap<int,E*>::const_iterator it = allEntity.find(id);
-            if (it != allEntity.end())
-                return SingleAccessWPtr<E>(it.value());
+            QReadLocker mapR(&s.lock);
+            typename QHash<int,E*>::const_iterator it = s.entities.constFind(id);
+            if (it != s.entities.constEnd())
+                return SingleAccessWPtr<E>(touch(it.value()));
         }
 
         // Load from DB if exists, else create fresh
@@ -378,19 +974,21 @@ public:
             fresh->moveToThread(targetThread);
 
         if (dbLoad(id, raw)) {
-            fresh->Deserialize(raw);
+            load(fresh.get(), raw);
         }
 
         E* e = fresh.release();
         {
-            QWriteLocker mapW(&lock_);
-            typename QMap<int,E*>::iterator it = allEntity.find(id);
-            if (it != allEntity.end()) {
+            QWriteLocker mapW(&s.lock);
+            typename QHash<int,E*>::iterator it = s.entities.find(id);
+            if (it != s.entities.end()) {
                 QMetaObject::invokeMethod(e, [e]{ e->deleteLater(); }, Qt::QueuedConnection);
-                return SingleAccessWPtr<E>(it.value());
+                return SingleAccessWPtr<E>(touch(it.value()));
             }
-            allEntity.insert(id, e);
+            s.entities.insert(id, e);
+            charge(id, e);
         }
+        maybeEvict();
         return SingleAccessWPtr<E>(e);
     }
 
@@ -400,35 +998,23 @@ public:
         QSharedPointer<QReadWriteLock> elock;
 
         {
-            QWriteLocker mapW(&lock_);
-            typename QMap<int,E*>::iterator it = allEntity.find(id);
-            if (it == allEntity.end())
+            Shard& s = shardOf(id);
+            QWriteLocker mapW(&s.lock);
+            typename QHash<int,E*>::iterator it = s.entities.find(id);
+            if (it == s.entities.end())
                 return false;
 
             e     = it.value();
             elock = e->Lock();
 
-            allEntity.erase(it);          // block new guards
-            swappingOut.insert(id);       // announce in-flight
+            s.entities.erase(it);         // block new guards
+            uncharge(e);
+            s.swappingOut.insert(id);     // announce in-flight
         } // release map lock
 
         // Wait out active users; then serialize to DB
         QWriteLocker entityW(elock.data());
-        const QByteArray raw = e->Serialize();
-        (void)dbUpsert(id, raw);          // best effort; handle failure per your policy
-
-        // Delete in object's thread
-        QMetaObject::invokeMethod(e, [e]{ e->deleteLater(); }, Qt::QueuedConnection);
-
-        // Flip state, wake waiters
-        {
-            QWriteLocker mapW(&lock_);
-            swappingOut.remove(id);
-        }
-        {
-            QMutexLocker g(&inflightMx);
-            inflightCv.wakeAll();
-        }
+        completeSwapOut(id, e);
         return true;
     }
 
@@ -438,19 +1024,20 @@ public:
                 QThread* targetThread = QThread::currentThread(),
                 QObject* parentForEntity = nullptr)
     {
+        Shard& s = shardOf(id);
         // Already in RAM?
         {
-            QReadLocker mapR(&lock_);
-            typename QMap<int,E*>::const_iterator it = allEntity.find(id);
-            if (it != allEntity.end()) return true;
+            QReadLocker mapR(&s.lock);
+            typename QHash<int,E*>::const_iterator it = s.entities.constFind(id);
+            if (it != s.entities.constEnd()) return true;
         }
 
         // If it's currently being swapped out, wait and re-check RAM
         waitWhileSwapping(id);
         {
-            QReadLocker mapR(&lock_);
-            typename QMap<int,E*>::const_iterator it = allEntity.find(id);
-            if (it != allEntity.end()) return true;
+            QReadLocker mapR(&s.lock);
+            typename QHash<int,E*>::const_iterator it = s.entities.constFind(id);
+            if (it != s.entities.constEnd()) return true;
         }
 
         // Load from DB; if not found, nothing to do
@@ -462,19 +1049,21 @@ public:
         if (fresh->thread() != targetThread)
             fresh->moveToThread(targetThread);
 
-        fresh->Deserialize(raw);
+        load(fresh.get(), raw);
         E* e = fresh.release();
 
         {
-            QWriteLocker mapW(&lock_);
-            typename QMap<int,E*>::iterator it = allEntity.find(id);
-            if (it != allEntity.end()) {
+            QWriteLocker mapW(&s.lock);
+            typename QHash<int,E*>::iterator it = s.entities.find(id);
+            if (it != s.entities.end()) {
                 // Another thread inserted while we were loading
                 QMetaObject::invokeMethod(e, [e]{ e->deleteLater(); }, Qt::QueuedConnection);
                 return true;
             }
-            allEntity.insert(id, e);
+            s.entities.insert(id, e);
+            charge(id, e);
         }
+        maybeEvict();
         return true;
     }
 
@@ -486,64 +1075,102 @@ public:
     {
         int brought = 0;
 
-        // Fast filter: skip ids already resident
+        // Fast filter: skip ids already resident, note those swapping out.
+        // Grouped by shard, so each shard's read lock is taken once
+        QVector<int> byShard = ids;
+        std::sort(byShard.begin(), byShard.end(), [](int a, int b) { return shardIndex(a) < shardIndex(b); });
         QVector<int> toLoad; toLoad.reserve(ids.size());
-        {
-            QReadLocker mapR(&lock_);
-            for (int id : ids) {
-                if (!allEntity.contains(id)) toLoad.push_back(id);
-            }
-        }
+        QVector<int> swapping;
+        scanByShard(byShard, [&toLoad, &swapping](const Shard& s, int id) {
+            if (s.entities.contains(id)) return;
+            toLoad.push_back(id);
+            if (s.swappingOut.contains(id)) swapping.push_back(id);
+        });
         if (toLoad.isEmpty()) return 0;
 
-        // Respect in-flight swaps: wait for any id currently swapping out
-        for (int id : toLoad) waitWhileSwapping(id);
+        // Respect in-flight swaps: wait only for ids currently swapping out
+        for (int id : swapping) waitWhileSwapping(id);
 
         // Re-check after waits (another thread may have loaded some)
         QVector<int> stillToLoad; stillToLoad.reserve(toLoad.size());
-        {
-            QReadLocker mapR(&lock_);
-            for (int id : toLoad) {
-                if (!allEntity.contains(id)) stillToLoad.push_back(id);
-            }
+        if (swapping.isEmpty()) {
+            stillToLoad = toLoad;
+        } else {
+            scanByShard(toLoad, [&stillToLoad](const Shard& s, int id) {
+                if (!s.entities.contains(id)) stillToLoad.push_back(id);
+            });
         }
         if (stillToLoad.isEmpty()) return 0;
 
-        // OPTIONAL: wrap the loads in a read-only transaction to improve locality.
-        // (safe to skip; SQLite will auto-handle reads fine)
-        {
-            QSqlDatabase db = dbForThread();
-            QSqlQuery qBegin(db); qBegin.exec(QStringLiteral("BEGIN;"));
-
-            for (int id : stillToLoad) {
-                QByteArray raw;
-                if (!dbLoad(id, raw)) continue; // not in DB; skip
-
-                std::unique_ptr<E> fresh(new E(parentForEntity));
-                if (fresh->thread() != targetThread)
-                    fresh->moveToThread(targetThread);
-                fresh->Deserialize(raw);
-                E* e = fresh.release();
-
-                bool inserted = false;
-                {
-                    QWriteLocker mapW(&lock_);
-                    if (!allEntity.contains(id)) {
-                        allEntity.insert(id, e);
-                        inserted = true;
+        ThreadDb* t = threadDb();
+        if (!t) return 0;
+
+        // One read transaction, InChunk ids per query; each chunk is deserialized
+        // in parallel and inserted taking each shard's lock once
+        t->db.transaction();
+        QSqlQuery tail(t->db);
+        tail.setForwardOnly(true);
+
+        for (int from = 0; from < stillToLoad.size(); from += InChunk) {
+            const int n = qMin(InChunk, int(stillToLoad.size()) - from);
+            // Full chunks reuse the thread's cached statement, the tail gets its own
+            if (n == InChunk && !t->chunkPrepared)
+                t->chunkPrepared = t->loadChunk.prepare(inQuery(InChunk));
+            QSqlQuery& q = n == InChunk ? t->loadChunk : tail;
+            if (n == InChunk ? !t->chunkPrepared : !q.prepare(inQuery(n))) break;
+            for (int i = 0; i < n; ++i) q.bindValue(i, stillToLoad[from + i]);
+            if (!q.exec()) break;
+
+            QVector<int> rowIds;
+            QVector<QByteArray> raws;
+            while (q.next()) {
+                rowIds.push_back(q.value(0).toInt());
+                raws.push_back(q.value(1).toByteArray());
+            }
+            q.finish();
+            if (rowIds.isEmpty()) continue;     // none of them in DB
+
+            // Objects are created and moved here, only Deserialize() runs on other threads
+            QVector<E*> fresh;
+            fresh.reserve(rowIds.size());
+            for (int i = 0; i < rowIds.size(); ++i) {
+                E* e = new E(parentForEntity);
+                if (e->thread() != targetThread)
+                    e->moveToThread(targetThread);
+                fresh.push_back(e);
+            }
+            deserializeParallel(fresh, raws);
+
+            QVector<int> order(rowIds.size());
+            std::iota(order.begin(), order.end(), 0);
+            std::sort(order.begin(), order.end(), [&rowIds](int a, int b) {
+                return shardIndex(rowIds[a]) < shardIndex(rowIds[b]);
+            });
+
+            QVector<E*> lost;
+            for (int k = 0; k < order.size(); ) {
+                const int shard = shardIndex(rowIds[order[k]]);
+                Shard& s = shards[shard];
+                QWriteLocker mapW(&s.lock);
+                for (; k < order.size() && shardIndex(rowIds[order[k]]) == shard; ++k) {
+                    const int i = order[k];
+                    if (s.entities.contains(rowIds[i])) {
+                        lost.push_back(fresh[i]);
+                        continue;
                     }
-                }
-                if (inserted) {
+                    s.entities.insert(rowIds[i], fresh[i]);
+                    charge(rowIds[i], fresh[i]);
                     ++brought;
-                } else {
-                    // Lost the race; discard duplicate safely in its thread
-                    QMetaObject::invokeMethod(e, [e]{ e->deleteLater(); }, Qt::QueuedConnection);
                 }
             }
+            // Lost the race; discard duplicates safely in their thread
+            for (E* e : lost)
+                QMetaObject::invokeMethod(e, [e]{ e->deleteLater(); }, Qt::QueuedConnection);
 
-            QSqlQuery qEnd(db); qEnd.exec(QStringLiteral("COMMIT;"));
+            maybeEvict();
         }
 
+        t->db.commit();
         return brought;
     }
 
@@ -554,16 +1181,20 @@ public:
             E* e = nullptr;
             QSharedPointer<QReadWriteLock> elock;
             {
-                QWriteLocker mapW(&lock_);
-                typename QMap<int,E*>::iterator it = allEntity.find(id);
-                if (it != allEntity.end()) {
+                Shard& s = shardOf(id);
+                QWriteLocker mapW(&s.lock);
+                typename QHash<int,E*>::iterator it = s.entities.find(id);
+                if (it != s.entities.end()) {
                     e     = it.value();
                     elock = e->Lock();
-                    allEntity.erase(it);
+                    s.entities.erase(it);
+                    uncharge(e);
                 }
             }
             if (e) {
                 QWriteLocker entityW(elock.data());
+                e->sink_.storeRelease(nullptr);
+                waitWhileFlushing(id);      // a flush in flight still uses e
                 QMetaObject::invokeMethod(e, [e]{ e->deleteLater(); }, Qt::QueuedConnection);
                 dbDelete(id); // purge from DB too
                 return true;
@@ -574,58 +1205,39 @@ public:
         waitWhileSwapping(id);
 
         // Not in RAM: delete DB row if present
+        waitWhileFlushing(id);
         return dbDelete(id);
     }
 
     // --- Clear RAM + purge SQLite table (no wait for deletes to complete) ---
     void Clear() {
         // Snapshot RAM
-        QList< QPair<E*, QSharedPointer<QReadWriteLock> > > snapshot;
-        {
-            QWriteLocker mapW(&lock_);
-            for (typename QMap<int,E*>::iterator it = allEntity.begin(); it != allEntity.end(); ++it)
-                snapshot.append(qMakePair(it.value(), it.value()->Lock()));
-            allEntity.clear();
-        }
+        QList< QPair<E*, QSharedPointer<QReadWriteLock> > > snapshot = takeAll();
+        waitUnused(snapshot);
+
         // Delete RAM entities safely
         for (int i = 0; i < snapshot.size(); ++i) {
             E* e = snapshot[i].first;
-            QSharedPointer<QReadWriteLock> elock = snapshot[i].second;
-            QWriteLocker entityW(elock.data());
             QMetaObject::invokeMethod(e, [e]{ e->deleteLater(); }, Qt::QueuedConnection);
         }
 
         // Wait out in-flight swaps then purge DB table
-        for (;;) {
-            bool any;
-            {
-                QReadLocker r(&lock_);
-                any = !swappingOut.isEmpty();
-            }
-            if (!any) break;
-            QMutexLocker g(&inflightMx);
-            inflightCv.wait(&inflightMx, 10);
-        }
+        for (Shard& s : shards)
+            waitShardIdle(s);
         dbDeleteAll();
     }
 
     // --- Clear and wait until all QObject destructions complete, then purge DB ---
     void ClearAndWait() {
         // Snapshot RAM
-        QList< QPair<E*, QSharedPointer<QReadWriteLock> > > snapshot;
-        {
-            QWriteLocker mapW(&lock_);
-            for (typename QMap<int,E*>::iterator it = allEntity.begin(); it != allEntity.end(); ++it)
-                snapshot.append(qMakePair(it.value(), it.value()->Lock()));
-            allEntity.clear();
-        }
+        QList< QPair<E*, QSharedPointer<QReadWriteLock> > > snapshot = takeAll();
+        waitUnused(snapshot);
 
         // Wait for actual destruction
         QAtomicInt remaining(snapshot.size());
         QEventLoop loop;
         for (int i = 0; i < snapshot.size(); ++i) {
             E* e = snapshot[i].first;
-            QSharedPointer<QReadWriteLock> elock = snapshot[i].second;
 
             QObject::connect(e, &QObject::destroyed, &loop,
                 [&remaining,&loop](QObject*) {
@@ -633,23 +1245,14 @@ public:
                         loop.quit();
                 }, Qt::QueuedConnection);
 
-            QWriteLocker entityW(elock.data());
             QMetaObject::invokeMethod(e, [e]{ e->deleteLater(); }, Qt::QueuedConnection);
         }
         if (remaining.loadAcquire() > 0)
             loop.exec();
 
         // Wait out in-flight swaps, then purge DB table
-        for (;;) {
-            bool any;
-            {
-                QReadLocker r(&lock_);
-                any = !swappingOut.isEmpty();
-            }
-            if (!any) break;
-            QMutexLocker g(&inflightMx);
-            inflightCv.wait(&inflightMx, 10);
-        }
+        for (Shard& s : shards)
+            waitShardIdle(s);
         dbDeleteAll();
     }
 };
@@ -1,20 +1,160 @@
 #include "tcpserver.h"
+#include "bufferpool.h"
+#include "upstream.h"
 #include <QTcpSocket>
 #include <QMetaObject>
-#include <QThreadPool>
 #include <QDateTime>
+#include <QDeadlineTimer>
+#include <QEventLoop>
+#include <QTimer>
+#include <QHash>
+#include <QAtomicInteger>
+#include <QtEndian>
+#include <cstring>
+#include <limits>
+
+#ifdef Q_OS_UNIX
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 //--------------------------------------------------------------------------------
 
-WorkerTask::WorkerTask(QByteArray data, QWeakPointer<ConnectionHandler> conn)
-    : data(std::move(data)), connection(conn) {}
+TimingWheel::TimingWheel(int tick, int slots, QObject *parent)
+    : QObject(parent), tickMs(qMax(tick, 1)), slotCount(qMax(slots, 1)),
+      heads(new Entry[size_t(qMax(slots, 1))]), timer(new QTimer(this))
+{
+    for (int i = 0; i < slotCount; ++i)
+        heads[i].prev = heads[i].next = &heads[i];
+
+    timer->setTimerType(Qt::CoarseTimer);
+    timer->setInterval(tickMs);
+    connect(timer, &QTimer::timeout, this, &TimingWheel::advance);
+}
+
+TimingWheel::~TimingWheel()
+{
+    // Entries may outlive the wheel (handler deleted after its thread finished)
+    for (int i = 0; i < slotCount; ++i) {
+        Entry *head = &heads[i];
+        for (Entry *e = head->next; e != head; ) {
+            Entry *next = e->next;
+            e->prev = e->next = nullptr;
+            e->wheel = nullptr;
+            e = next;
+        }
+        head->prev = head->next = head;
+    }
+}
+
+qint64 TimingWheel::now()
+{
+    return QDeadlineTimer::current().deadline();
+}
+
+void TimingWheel::link(Entry *head, Entry *e)
+{
+    e->prev = head->prev;
+    e->next = head;
+    head->prev->next = e;
+    head->prev = e;
+}
+
+void TimingWheel::unlink(Entry *e)
+{
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+    e->prev = e->next = nullptr;
+}
+
+void TimingWheel::schedule(Entry *e, qint64 due)
+{
+    Q_ASSERT(thread() == QThread::currentThread());
+
+    if (e->wheel == this) {
+        unlink(e);
+    } else {
+        if (e->wheel) e->wheel->cancel(e);
+        e->wheel = this;
+        ++size;
+    }
+    if (!timer->isActive()) {
+        nextTick = now() + tickMs;
+        timer->start();
+    }
+
+    // Ticks from the slot under the cursor, at least the next one
+    const qint64 base = nextTick - tickMs;
+    const qint64 ticks = qMax<qint64>(1, (due - base + tickMs - 1) / tickMs);
+    e->rounds = int(qMin<qint64>((ticks - 1) / slotCount, std::numeric_limits<int>::max()));
+    link(&heads[int((cursor + ticks) % slotCount)], e);
+}
+
+void TimingWheel::cancel(Entry *e)
+{
+    if (e->wheel != this) return;
+    unlink(e);
+    e->wheel = nullptr;
+    --size;
+}
+
+void TimingWheel::advance()
+{
+    const qint64 t = now();
+    while (nextTick <= t && size > 0) {
+        nextTick += tickMs;
+        cursor = (cursor + 1) % slotCount;
+        Entry *head = &heads[cursor];
+        if (head->next == head) continue;
+
+        // Detach the slot: fire() may schedule, cancel or delete any entry
+        Entry due;
+        due.next = head->next;
+        due.prev = head->prev;
+        due.next->prev = &due;
+        due.prev->next = &due;
+        head->prev = head->next = head;
+
+        while (due.next != &due) {
+            Entry *e = due.next;
+            unlink(e);
+            if (e->rounds > 0) {
+                --e->rounds;
+                link(head, e);
+                continue;
+            }
+            e->wheel = nullptr;
+            --size;
+            e->fire();
+        }
+    }
+    if (size == 0)
+        timer->stop();
+}
+
+//--------------------------------------------------------------------------------
+
+QByteArray MessageBatch::message(int i) const
+{
+    const Frame &f = frames[i];
+    if (f.offset == 0 && f.size == buffer.size())
+        return buffer;
+    return buffer.mid(f.offset, f.size);
+}
+
+//--------------------------------------------------------------------------------
+
+WorkerTask::WorkerTask(QWeakPointer<ConnectionHandler> conn)
+    : connection(conn) {}
 
 void WorkerTask::run()
 {
     if (auto conn = connection)
     {
         if (auto sh = connection.lock()) {
-            sh->service(data);
+            sh->drainStrand();
         }
     }
 }
@@ -25,36 +165,551 @@ ConnectionHandler::ConnectionHandler(QTcpSocket *sock, qint64 id, QObject *paren
     : QObject(parent), socket_(sock)
 {
     connectionId = id;
+    liveness.owner = this;
+    acceptedAt = TimingWheel::now();
+    lastRead.storeRelaxed(acceptedAt);
+    lastWrite.storeRelaxed(acceptedAt);
 
     connect(socket_, &QTcpSocket::readyRead, this, &ConnectionHandler::onReadyRead);
     connect(socket_, &QTcpSocket::disconnected, this, &ConnectionHandler::onDisconnected);
+    connect(socket_, &QTcpSocket::bytesWritten, this, &ConnectionHandler::onBytesWritten);
 }
 
-void ConnectionHandler::send(const QByteArray &data)
+ConnectionHandler::SendResult ConnectionHandler::send(const QByteArray &data, quint64 key)
 {
-    QPointer<QTcpSocket> sock = socket_;
-    if (!sock) return;
+    bool flush = false;
+    SendResult result = enqueue(data, key, flush);
+    if (flush) {
+        QMetaObject::invokeMethod(
+            this,
+            &ConnectionHandler::flushOutbound,
+            Qt::QueuedConnection  // ensure it runs in socket's thread
+            );
+    }
+    return result;
+}
 
-    QMetaObject::invokeMethod(
-        sock,
-        [sock, data]() {
-            if (sock && sock->state() == QAbstractSocket::ConnectedState) {
-                sock->write(data);
+ConnectionHandler::SendResult ConnectionHandler::sendLocal(const QByteArray &data, quint64 key)
+{
+    Q_ASSERT(thread() == QThread::currentThread());
+
+    bool flush = false;
+    SendResult result = enqueue(data, key, flush);
+    if (flush) flushOutbound();
+    return result;
+}
+
+ConnectionHandler::SendResult ConnectionHandler::enqueue(const QByteArray &data, quint64 key, bool &flush)
+{
+    if (!socket_) return NotConnected;
+
+    SendResult result = Queued;
+    bool becameCongested = false;
+    {
+        QMutexLocker locker(&outMutex);
+
+        if (highWatermark > 0 && !congested.loadRelaxed()
+            && queuedBytes() + data.size() > highWatermark) {
+            congested.storeRelaxed(1);
+            becameCongested = true;
+        }
+
+        if (congested.loadRelaxed()) {
+            result = sendCongested(data, key);
+        } else {
+            outQueue.append({data, key});
+            pendingBytes.fetchAndAddRelaxed(data.size());
+        }
+
+        // One flush per burst, it will take this too
+        if (!flushPending && !waitingForSocket && !outQueue.isEmpty()) {
+            flushPending = true;
+            flush = true;
+        }
+    }
+
+    if (becameCongested) emit pressureChanged(connectionId, true);
+    return result;
+}
+
+ConnectionHandler::SendResult ConnectionHandler::sendCongested(const QByteArray &data, quint64 key)
+{
+    switch (slowPolicy) {
+    case DropNewest:
+        return Dropped;
+
+    case DropOldest:
+        // Only messages not yet handed to the socket can be dropped, newest is kept.
+        while (!outQueue.isEmpty() && queuedBytes() + data.size() > highWatermark) {
+            pendingBytes.fetchAndAddRelaxed(-outQueue.first().data.size());
+            outQueue.removeFirst();
+        }
+        if (queuedBytes() + data.size() > highWatermark)
+            return Dropped;
+        outQueue.append({data, key});
+        pendingBytes.fetchAndAddRelaxed(data.size());
+        return Queued;
+
+    case Conflate:
+        if (key == 0) return Dropped;
+        for (auto &out : outQueue) {
+            if (out.key == key) {
+                pendingBytes.fetchAndAddRelaxed(data.size() - out.data.size());
+                out.data = data;
+                return Conflated;
             }
-        },
-        Qt::QueuedConnection  // ensure it runs in socket's thread
-        );
+        }
+        // New key: queue grows by number of keys, not by message rate.
+        outQueue.append({data, key});
+        pendingBytes.fetchAndAddRelaxed(data.size());
+        return Queued;
+
+    case Disconnect:
+        for (const auto &out : outQueue)
+            pendingBytes.fetchAndAddRelaxed(-out.data.size());
+        outQueue.clear();
+        // One abort per connection, however many sends arrive before it runs
+        if (abortPosted.testAndSetRelaxed(0, 1)) {
+            QMetaObject::invokeMethod(this, [this]{
+                if (socket_) socket_->abort();
+            }, Qt::QueuedConnection);
+        }
+        return Disconnected;
+    }
+    return Dropped;
+}
+
+void ConnectionHandler::setWatermarks(qint64 high, qint64 low, SlowConsumerPolicy policy)
+{
+    QMutexLocker locker(&outMutex);
+    highWatermark = high;
+    lowWatermark = qMin(low, high);
+    slowPolicy = policy;
+}
+
+void ConnectionHandler::checkRecovered()
+{
+    bool recovered = false;
+    {
+        QMutexLocker locker(&outMutex);
+        if (congested.loadRelaxed() && queuedBytes() <= lowWatermark) {
+            congested.storeRelaxed(0);
+            recovered = true;
+        }
+    }
+    if (recovered) emit pressureChanged(connectionId, false);
+}
+
+void ConnectionHandler::onBytesWritten()
+{
+    socketBytes.storeRelaxed(socket_->bytesToWrite());
+
+    // Socket made room, hand it what backpressure held back
+    bool more;
+    {
+        QMutexLocker locker(&outMutex);
+        more = !outQueue.isEmpty() && !flushPending;
+    }
+    if (more)
+        flushOutbound();
+    else
+        checkRecovered();
+}
+
+void ConnectionHandler::flushOutbound()
+{
+    QVector<Outbound> work;
+    qint64 high;
+    {
+        QMutexLocker locker(&outMutex);
+        work.swap(outQueue);
+        flushPending = false;
+        waitingForSocket = false;
+        high = highWatermark;
+    }
+
+    if (!socket_ || socket_->state() != QAbstractSocket::ConnectedState) {
+        // Nothing will write the batch, take it out of pendingBytes as closeNow() does
+        qint64 dropped = 0;
+        for (const Outbound &out : work)
+            dropped += out.data.size();
+        pendingBytes.fetchAndAddRelaxed(-dropped);
+        return;
+    }
+
+    // With watermarks the socket buffer is kept below high watermark, the rest
+    // stays in outQueue where the slow consumer policy can still act on it.
+    const qint64 room = high > 0 ? high - socket_->bytesToWrite()
+                                 : std::numeric_limits<qint64>::max();
+
+    // QTcpSocket has no vectored write, so small buffers are joined into a pooled chunk.
+    QByteArray chunk;
+    bool pooled = false;
+    qint64 written = 0;
+    int i = 0;
+    for (; i < work.size(); ++i) {
+        const QByteArray &data = work[i].data;
+        if (written + data.size() > room && (written > 0 || room <= 0))
+            break;
+        written += data.size();
+
+        if (chunk.size() + data.size() > WriteChunk && !chunk.isEmpty()) {
+            socket_->write(chunk);
+            if (pooled)
+                chunk.resize(0);    // keeps capacity
+            else
+                chunk = QByteArray();
+        }
+        if (data.size() >= WriteChunk) {
+            socket_->write(data);
+            continue;
+        }
+        if (chunk.isEmpty() && !pooled) {
+            chunk = data;   // shared, a lone message is written without copying
+        } else {
+            if (!pooled) {
+                QByteArray c = BufferPool::acquire(WriteChunk);
+                c.append(chunk);
+                chunk = std::move(c);
+                pooled = true;
+            }
+            chunk.append(data);
+        }
+    }
+    if (!chunk.isEmpty())
+        socket_->write(chunk);
+
+    socket_->flush();
+    if (written > 0)
+        lastWrite.storeRelaxed(TimingWheel::now());
+    writtenMessages.fetchAndAddRelaxed(i);
+
+    // The socket copied everything written, recycle what we solely own
+    if (pooled)
+        BufferPool::release(std::move(chunk));
+    chunk = QByteArray();
+    for (int j = 0; j < i; ++j)
+        BufferPool::release(std::move(work[j].data));
+
+    {
+        QMutexLocker locker(&outMutex);
+        if (i < work.size()) {
+            // Held back messages go in front of anything sent meanwhile
+            work.remove(0, i);
+            work.append(std::move(outQueue));
+            outQueue = std::move(work);
+            waitingForSocket = true;    // bytesWritten resumes the flush
+        }
+        pendingBytes.fetchAndAddRelaxed(-written);
+        socketBytes.storeRelaxed(socket_->bytesToWrite());
+    }
+    checkRecovered();
+}
+
+ConnectionHandler::SendResult ConnectionHandler::sendFrame(const QByteArray &payload)
+{
+    // Never write a frame the length field can't hold or the peer's framing would refuse
+    if (framing != RawFraming) {
+        qint64 limit = maxFrameSize;
+        if (framing == LengthPrefixed && lengthFieldSize < 4)
+            limit = qMin(limit, (qint64(1) << (8 * lengthFieldSize)) - 1);
+        if (payload.size() > limit) {
+            qWarning() << "Connection" << connectionId << "frame of" << payload.size() << "bytes exceeds" << limit << ", dropped";
+            return Dropped;
+        }
+    }
+
+    if (framing == Delimited) {
+        QByteArray frame = BufferPool::acquire(payload.size() + delimiter.size());
+        frame.append(payload);
+        frame.append(delimiter);
+        return send(frame);
+    }
+    if (framing != LengthPrefixed)
+        return send(payload);
+
+    QByteArray frame = BufferPool::acquire(lengthFieldSize + payload.size());
+    frame.resize(lengthFieldSize + payload.size());
+    uchar *h = reinterpret_cast<uchar*>(frame.data());
+    switch (lengthFieldSize) {
+    case 1: *h = uchar(payload.size()); break;
+    case 2: qToBigEndian(quint16(payload.size()), h); break;
+    default: qToBigEndian(quint32(payload.size()), h); break;
+    }
+    memcpy(frame.data() + lengthFieldSize, payload.constData(), payload.size());
+    return send(frame);
+}
+
+void ConnectionHandler::setIdleTimeout(int ms)
+{
+    idleTimeout = qMax(ms, 0);
+    scheduleLiveness();
+}
+
+void ConnectionHandler::setHeartbeat(int intervalMs, const QByteArray &payload)
+{
+    heartbeatInterval = qMax(intervalMs, 0);
+    heartbeatPayload = payload;
+    scheduleLiveness();
+}
+
+void ConnectionHandler::setLoginDeadline(int ms)
+{
+    loginTimeout = qMax(ms, 0);
+    scheduleLiveness();
+}
+
+void ConnectionHandler::setTimingWheel(TimingWheel *w)
+{
+    if (wheel) wheel->cancel(&liveness);
+    wheel = w;
+    scheduleLiveness();
+}
+
+void ConnectionHandler::setSessionId(qint64 id)
+{
+    sessionId.storeRelease(id);
+    // Liveness lives on the handler's thread, let it drop the login deadline there
+    QMetaObject::invokeMethod(this, &ConnectionHandler::scheduleLiveness, Qt::QueuedConnection);
+}
+
+void ConnectionHandler::scheduleLiveness()
+{
+    if (!wheel) return;     // armed once TcpServer sets the wheel
+
+    qint64 due = std::numeric_limits<qint64>::max();
+    if (loginTimeout > 0 && sessionId.loadAcquire() == 0)
+        due = qMin(due, acceptedAt + loginTimeout);
+    if (idleTimeout > 0)
+        due = qMin(due, lastRead.loadRelaxed() + idleTimeout);
+    if (heartbeatInterval > 0)
+        due = qMin(due, lastWrite.loadRelaxed() + heartbeatInterval);
+
+    if (due == std::numeric_limits<qint64>::max())
+        wheel->cancel(&liveness);
+    else
+        wheel->schedule(&liveness, due);
+}
+
+void ConnectionHandler::checkLiveness()
+{
+    if (!socket_ || socket_->state() != QAbstractSocket::ConnectedState)
+        return;
+
+    const qint64 now = TimingWheel::now();
+    if (loginTimeout > 0 && sessionId.loadAcquire() == 0 && now - acceptedAt >= loginTimeout) {
+        expired(LoginTimeout);
+        return;
+    }
+    if (idleTimeout > 0 && now - lastRead.loadRelaxed() >= idleTimeout) {
+        expired(IdleTimeout);
+        return;
+    }
+    if (heartbeatInterval > 0 && now - lastWrite.loadRelaxed() >= heartbeatInterval) {
+        lastWrite.storeRelaxed(now);    // flush stamps it again once written
+        sendFrame(heartbeatPayload);
+    }
+    scheduleLiveness();
+}
+
+void ConnectionHandler::expired(Timeout reason)
+{
+    qDebug() << "Connection" << connectionId
+             << (reason == LoginTimeout ? "missed login deadline, aborting" : "idle timeout, aborting");
+    if (socket_) socket_->abort();
+}
+
+bool ConnectionHandler::isServicing()
+{
+    QMutexLocker locker(&strandMutex);
+    return strandScheduled || !strandQueue.isEmpty();
+}
+
+int ConnectionHandler::closeNow()
+{
+    int dropped = 0;
+    {
+        QMutexLocker locker(&strandMutex);
+        for (const auto &batch : strandQueue)
+            dropped += batch.count();
+        strandQueue.clear();
+    }
+    {
+        QMutexLocker locker(&outMutex);
+        dropped += outQueue.size();
+        outQueue.clear();
+        pendingBytes.storeRelaxed(0);
+    }
+    if (wheel) wheel->cancel(&liveness);
+    if (socket_) socket_->disconnectFromHost();     // writes what the socket buffered first
+    return dropped;
+}
+
+qint64 ConnectionHandler::abortNow()
+{
+    if (!socket_ || socket_->state() == QAbstractSocket::UnconnectedState)
+        return 0;
+    const qint64 unwritten = socket_->bytesToWrite();
+    socket_->abort();
+    return unwritten;
+}
+
+quint64 ConnectionHandler::sendUpstream(const QByteArray &payload)
+{
+    return upstream ? upstream->request(connectionId, sessionId.loadAcquire(), payload) : 0;
+}
+
+void ConnectionHandler::setFraming(Framing f, int maxSize, int lengthSize, const QByteArray &delim)
+{
+    Q_ASSERT(lengthSize == 1 || lengthSize == 2 || lengthSize == 4);
+    Q_ASSERT(f != Delimited || !delim.isEmpty());
+
+    framing = f;
+    maxFrameSize = maxSize;
+    lengthFieldSize = lengthSize;
+    delimiter = delim;
+}
+
+void ConnectionHandler::serviceBatch(const MessageBatch &batch)
+{
+    for (int i = 0; i < batch.count(); ++i)
+        service(batch.message(i));
+}
+
+bool ConnectionHandler::extractFrames(MessageBatch &batch)
+{
+    const char *p = inbound.constData();
+    const int size = int(inbound.size());
+    int pos = 0;
+
+    if (framing == LengthPrefixed) {
+        while (size - pos >= lengthFieldSize) {
+            const uchar *h = reinterpret_cast<const uchar*>(p + pos);
+            qint64 len;
+            switch (lengthFieldSize) {
+            case 1: len = *h; break;
+            case 2: len = qFromBigEndian<quint16>(h); break;
+            default: len = qFromBigEndian<quint32>(h); break;
+            }
+            if (len > maxFrameSize) return false;
+            if (size - pos - lengthFieldSize < len) break;   // partial
+
+            batch.frames.append(MessageBatch::Frame{pos + lengthFieldSize, int(len)});
+            pos += lengthFieldSize + int(len);
+        }
+    } else {
+        for (;;) {
+            int end = int(inbound.indexOf(delimiter, pos));
+            if (end < 0) {
+                if (size - pos > maxFrameSize) return false;
+                break;   // partial
+            }
+            if (end - pos > maxFrameSize) return false;
+
+            batch.frames.append(MessageBatch::Frame{pos, end - pos});
+            pos = end + int(delimiter.size());
+        }
+    }
+
+    // Frames point into the shared buffer, only the partial tail is copied.
+    if (!batch.frames.isEmpty())
+        batch.buffer = inbound;
+    if (pos > 0) {
+        if (pos < size) {
+            QByteArray tail = BufferPool::acquire(size - pos);
+            tail.append(p + pos, size - pos);
+            inbound = std::move(tail);
+        } else {
+            inbound = QByteArray();
+        }
+    }
+    return true;
 }
 
 void ConnectionHandler::onReadyRead() {
-    QByteArray data = socket_->readAll();
-    auto *task = new WorkerTask(data, self_);
-    QThreadPool::globalInstance()->start(task);
+    if (draining.loadRelaxed()) return;     // shutting down, leave it unread
+
+    // Read into pooled storage, not a fresh readAll() buffer
+    const qint64 available = socket_->bytesAvailable();
+    if (available <= 0) return;
+
+    QByteArray data = BufferPool::acquire(available);
+    data.resize(available);
+    const qint64 got = socket_->read(data.data(), available);
+    if (got <= 0) {
+        BufferPool::release(std::move(data));
+        return;
+    }
+    data.resize(got);
+    lastRead.storeRelaxed(TimingWheel::now());
+
+    MessageBatch batch;
+    if (framing == RawFraming) {
+        batch = MessageBatch(std::move(data));
+    } else {
+        if (inbound.isEmpty()) {
+            inbound = std::move(data);      // common case, no copy
+        } else {
+            inbound.append(data);
+            BufferPool::release(std::move(data));
+        }
+
+        if (!extractFrames(batch)) {
+            qWarning() << "Connection" << connectionId << "frame exceeds" << maxFrameSize << "bytes, aborting";
+            inbound.clear();
+            socket_->abort();
+            return;
+        }
+        if (batch.isEmpty()) return;
+    }
+
+    dispatch(std::move(batch));
+}
+
+// Rounds one WorkerTask drains before yielding its pool slot to other connections
+static const int StrandRounds = 16;
+
+void ConnectionHandler::dispatch(MessageBatch batch)
+{
+    {
+        QMutexLocker locker(&strandMutex);
+        strandQueue.append(std::move(batch));
+        if (strandScheduled) return;    // running task will pick it up
+        strandScheduled = true;
+    }
+    (executor ? executor : &WorkStealingExecutor::instance())->start(new WorkerTask(self_));
+}
+
+void ConnectionHandler::drainStrand()
+{
+    QVector<MessageBatch> work;
+
+    for (int round = 0; round < StrandRounds; ++round) {
+        {
+            QMutexLocker locker(&strandMutex);
+            if (strandQueue.isEmpty()) {
+                strandScheduled = false;
+                return;
+            }
+            work.swap(strandQueue);
+        }
+
+        for (auto &batch : work) {
+            serviceBatch(batch);
+            BufferPool::release(std::move(batch.buffer));  // kept by pool unless service() still shares it
+        }
+        work.clear();
+    }
+
+    // Still busy: requeue behind other connections, strand stays scheduled
+    (executor ? executor : &WorkStealingExecutor::instance())->start(new WorkerTask(self_));
 }
 
 void ConnectionHandler::onDisconnected() {
     qDebug() << "Disconnected:" << socket_->peerAddress();
 
+    if (wheel) wheel->cancel(&liveness);
+
     ConnectionManager::instance().unregisterConnection(connectionId);
 
     socket_->deleteLater();
@@ -88,93 +743,366 @@ void ConnectionManager::setSessionId(qint64 cId, qint64 sessId)
 
     // If this session was bound to another connection, sever that first
     if (sessionToConnectionIDs.contains(sessId)) {
-        auto oldConn = sessionToConnectionIDs[sessId];
+        auto oldConn = sessionToConnectionIDs.value(sessId);
         connectionToSessionIDs.remove(oldConn);
+        // Its upstream requests and liveness must not carry the session any more
+        if (oldConn != cId) {
+            if (auto old = connections.value(oldConn))
+                old->setSessionId(0);
+        }
     }
 
     // Bind both ways
-    sessionToConnectionIDs[sessId] = cId;
+    sessionToConnectionIDs.insert(sessId, cId);
     connectionToSessionIDs[cId] = sessId;
+    conn->setSessionId(sessId);
 }
 
 QSharedPointer<ConnectionHandler> ConnectionManager::Connection(qint64 id)
 {
-    QMutexLocker locker(&mutex);
-    if (connections.contains(id) && connections[id]) {
-        return connections[id];
-    }
-    return QSharedPointer<ConnectionHandler>(nullptr);
+    return connections.value(id);
+}
+
+QVector<QSharedPointer<ConnectionHandler>> ConnectionManager::connectionList() const
+{
+    QVector<QSharedPointer<ConnectionHandler>> list;
+    connections.forEach([&list](qint64, const QSharedPointer<ConnectionHandler> &conn) {
+        list.append(conn);
+    });
+    return list;
 }
 
 QSharedPointer<ConnectionHandler> ConnectionManager::ConnectionBySession(qint64 sid)
 {
-    QMutexLocker locker(&mutex);
-    if (sessionToConnectionIDs.contains(sid))
-    {
-        auto cId = sessionToConnectionIDs[sid];
-        if (connections.contains(cId) && connections[cId]) {
-            return connections[cId];
-        }
-    }
-    return QSharedPointer<ConnectionHandler>(nullptr);
+    qint64 cId = sessionToConnectionIDs.value(sid, -1);
+    if (cId < 0) return QSharedPointer<ConnectionHandler>(nullptr);
+    return connections.value(cId);
 }
 
 void ConnectionManager::registerConnection(qint64 id, ConnectionHandler *conn) {
     QMutexLocker locker(&mutex);
-    connections[id] = QSharedPointer<ConnectionHandler>(conn);
-    connections[id]->setSelfWeak(connections[id].toWeakRef());
+    // Handler may live on an I/O thread, let it be deleted there.
+    QSharedPointer<ConnectionHandler> shared(conn, &QObject::deleteLater);
+    shared->setSelfWeak(shared.toWeakRef());
+    connections.insert(id, shared);
+
+    connect(conn, &ConnectionHandler::pressureChanged, this, &ConnectionManager::pressureChanged);
 
-    // Auto-unregister when the socket disconnects or is destroyed
+    // Broadcast posts one batch per thread, it needs an object living there.
+    QThread *t = conn->thread();
+    if (!threadContexts.contains(t)) {
+        auto *ctx = new QObject;
+        if (t != QThread::currentThread()) ctx->moveToThread(t);
+        threadContexts.insert(t, ctx);
+        connect(t, &QThread::finished, ctx, &QObject::deleteLater);
+        connect(ctx, &QObject::destroyed, this, [this, t]{
+            QMutexLocker lk(&mutex);
+            threadContexts.remove(t);
+        }, Qt::DirectConnection);
+    }
+
+    // Join its thread's broadcast group
+    const BroadcastSnapshot *current = snapshot.load();
+    auto *next = current ? new BroadcastSnapshot(*current) : new BroadcastSnapshot;
+    int g = 0;
+    while (g < next->groups.size() && next->groups[g].thread != t)
+        ++g;
+    if (g == next->groups.size())
+        next->groups.append(BroadcastSnapshot::Group{t, nullptr, {}});
+    next->groups[g].context = threadContexts.value(t);   // may be a new one, if the old left with its thread
+    next->groups[g].handlers.append(shared);
+    snapshot.publish(snapshotEpoch, next);
+
+    // Auto-unregister when the socket disconnects or is destroyed.
+    // Direct connection: run on the socket's thread instead of bouncing to ours.
     connect(conn->socket(), &QTcpSocket::disconnected, this, [this, id]{
         unregisterConnection(id);
-    });
+    }, Qt::DirectConnection);
     connect(conn->socket(), &QObject::destroyed, this, [this, id]{
         unregisterConnection(id);
-    });
+    }, Qt::DirectConnection);
 }
 
 void ConnectionManager::unregisterConnection(qint64 id) {
-    QMutexLocker locker(&mutex);
+    {
+        QMutexLocker locker(&mutex);
 
-    if (!connections.contains(id))
-        return;
+        if (!connections.contains(id))
+            return;
 
-    // Drop session mapping if present
-    if (connectionToSessionIDs.contains(id)) {
-        qint64 sid = connectionToSessionIDs.take(id);
-        sessionToConnectionIDs.remove(sid);
-    }
+        // Drop session mapping if present
+        if (connectionToSessionIDs.contains(id)) {
+            qint64 sid = connectionToSessionIDs.take(id);
+            sessionToConnectionIDs.remove(sid);
+        }
+
+        // The QSharedPointer delete ConnectionHandler object.
+        QSharedPointer<ConnectionHandler> doomed;
 
-    // The QSharedPointer delete ConnectionHandler object.
-    QSharedPointer<ConnectionHandler> doomed;
+        // Drop session mappings as you do now...
+        doomed = connections.take(id);    // last strong ref may be here
+        connections.synchronize(id);      // or in a replaced shard copy, free those now
 
-    // Drop session mappings as you do now...
-    doomed = connections.take(id);    // last strong ref may be here
+        // Leave its broadcast group; the replaced snapshot holds strong refs too, free it now
+        if (const BroadcastSnapshot *current = snapshot.load()) {
+            auto *next = new BroadcastSnapshot(*current);
+            for (int g = 0; g < next->groups.size(); ++g) {
+                auto &group = next->groups[g];
+                if (group.thread != doomed->thread()) continue;
+                group.handlers.removeOne(doomed);
+                if (group.handlers.isEmpty())
+                    next->groups.removeAt(g);
+                break;
+            }
+            snapshot.publish(snapshotEpoch, next);
+            snapshotEpoch.synchronize();
+        }
+    }
+
+    // Subscriptions go with the connection
+    removeSubscriptions(id);
 }
 
-void ConnectionManager::sendToConnection(qint64 id, const QByteArray &data) {    
-    QSharedPointer<ConnectionHandler> conn;
-    { QMutexLocker lk(&mutex); conn = connections.value(id); }
-    if (conn) conn->send(data);
+ConnectionHandler::SendResult ConnectionManager::sendToConnection(qint64 id, const QByteArray &data, quint64 key) {
+    auto conn = connections.value(id);
+    if (!conn) return ConnectionHandler::NotConnected;
+    return conn->send(data, key);
 }
 
-void ConnectionManager::sendToSession(qint64 sid, const QByteArray &data)
+ConnectionHandler::SendResult ConnectionManager::sendToSession(qint64 sid, const QByteArray &data, quint64 key)
 {
-    qint64 cId = -1;
+    qint64 cId = sessionToConnectionIDs.value(sid, -1);
+    if (cId < 0) return ConnectionHandler::NotConnected;
+    return sendToConnection(cId, data, key);
+}
+
+int ConnectionManager::broadcast(const QByteArray &data, quint64 key) {
+    // Groups and handler lists are implicitly shared, taking them copies no connection
+    QVector<BroadcastSnapshot::Group> groups;
     {
-        QMutexLocker locker(&mutex);
-        cId = sessionToConnectionIDs.value(sid, -1);
+        EpochDomain::ReadGuard guard(snapshotEpoch);
+        if (const BroadcastSnapshot *snap = snapshot.load())
+            groups = snap->groups;
+    }
+
+    // QByteArray is implicitly shared: every connection queues the same buffer, nothing is copied.
+    int congested = 0;
+    for (const auto &group : std::as_const(groups)) {
+        for (const auto &conn : group.handlers) {
+            if (conn->isCongested()) ++congested;
+        }
+
+        if (!group.context) continue;   // thread is gone
+
+        // One event per I/O thread, handlers are written there directly.
+        QMetaObject::invokeMethod(
+            group.context,
+            [handlers = group.handlers, data, key]() {
+                for (const auto &conn : handlers)
+                    conn->sendLocal(data, key);
+            },
+            Qt::QueuedConnection
+            );
+    }
+    return congested;
+}
+
+void ConnectionManager::fanOut(QVector<QSharedPointer<ConnectionHandler>> targets, const QByteArray &data, quint64 key)
+{
+    QHash<QThread*, QVector<QSharedPointer<ConnectionHandler>>> byThread;
+    for (auto &conn : targets)
+        byThread[conn->thread()].append(std::move(conn));
+
+    for (auto it = byThread.begin(); it != byThread.end(); ++it) {
+        // The lambda holds strong refs, so the first handler outlives the event
+        ConnectionHandler *context = it->first().data();
+        QMetaObject::invokeMethod(
+            context,
+            [handlers = std::move(*it), data, key]() {
+                for (const auto &conn : handlers)
+                    conn->sendLocal(data, key);
+            },
+            Qt::QueuedConnection
+            );
+    }
+}
+
+// Wildcard topic to its prefix key: "a.b.*" -> "a.b.", "*" -> "". False for exact topic.
+static bool wildcardPrefix(const QString &topic, QString &prefix)
+{
+    if (topic == QLatin1String("*") || topic.endsWith(QLatin1String(".*"))) {
+        prefix = topic.chopped(1);
+        return true;
     }
+    return false;
+}
+
+bool ConnectionManager::subscribe(qint64 sessionId, const QString &topic)
+{
+    auto conn = ConnectionBySession(sessionId);
+    if (!conn) return false;
+
+    QMutexLocker lk(&mutex);
+
+    // Unregistered meanwhile: its removeSubscriptions() may be done already, so don't add one.
+    // Still registered: removeSubscriptions() waits for mutex and drops this one too.
+    if (!connections.contains(conn->connectionId)) return false;
+
+    auto &mine = connectionTopics[conn->connectionId];
+    if (mine.contains(topic)) return true;     // already there
+
+    const TopicIndex *current = topics.load();
+    auto *index = current ? new TopicIndex(*current) : new TopicIndex;
+    QString prefix;
+    auto &slot = wildcardPrefix(topic, prefix) ? index->prefix[prefix] : index->exact[topic];
+
+    auto subs = slot ? std::make_shared<TopicIndex::Subscribers>(*slot)
+                     : std::make_shared<TopicIndex::Subscribers>();
+    subs->append({conn->connectionId, conn.toWeakRef()});
+    slot = std::move(subs);
+
+    mine.insert(topic);
+    topics.publish(topicEpoch, index);
+    return true;
+}
+
+void ConnectionManager::unsubscribe(qint64 sessionId, const QString &topic)
+{
+    qint64 cId = sessionToConnectionIDs.value(sessionId, -1);
     if (cId < 0) return;
-    sendToConnection(cId, data);
+
+    QMutexLocker lk(&mutex);
+    auto it = connectionTopics.find(cId);
+    if (it == connectionTopics.end() || !it->remove(topic)) return;
+    if (it->isEmpty()) connectionTopics.erase(it);
+
+    auto *index = new TopicIndex(*topics.load());
+    dropSubscriber(*index, cId, topic);
+    topics.publish(topicEpoch, index);
 }
 
-void ConnectionManager::broadcast(const QByteArray &data) {    
-    QList<QSharedPointer<ConnectionHandler>> list;
-    { QMutexLocker lk(&mutex); list = connections.values(); }
-    for (auto& conn : list) {
-        if (conn) conn->send(data);
+void ConnectionManager::removeSubscriptions(qint64 connectionId)
+{
+    QMutexLocker lk(&mutex);
+    auto it = connectionTopics.find(connectionId);
+    if (it == connectionTopics.end()) return;
+
+    auto *index = new TopicIndex(*topics.load());
+    for (const auto &topic : std::as_const(*it))
+        dropSubscriber(*index, connectionId, topic);
+    connectionTopics.erase(it);
+
+    topics.publish(topicEpoch, index);
+}
+
+void ConnectionManager::dropSubscriber(TopicIndex &index, qint64 connectionId, const QString &topic)
+{
+    QString key = topic;
+    auto &map = wildcardPrefix(topic, key) ? index.prefix : index.exact;
+
+    auto it = map.find(key);
+    if (it == map.end()) return;
+
+    auto subs = std::make_shared<TopicIndex::Subscribers>(**it);
+    subs->removeIf([connectionId](const TopicIndex::Subscriber &s) { return s.connectionId == connectionId; });
+    if (subs->isEmpty())
+        map.erase(it);
+    else
+        *it = std::move(subs);
+}
+
+int ConnectionManager::publish(const QString &topic, const QByteArray &data, quint64 key)
+{
+    QVector<QSharedPointer<ConnectionHandler>> targets;
+    int lists = 0;
+    auto collect = [&](const QHash<QString, std::shared_ptr<const TopicIndex::Subscribers>> &map, const QString &k) {
+        auto it = map.constFind(k);
+        if (it == map.constEnd()) return;
+        ++lists;
+        for (const auto &sub : std::as_const(**it)) {
+            if (auto conn = sub.handler.toStrongRef())
+                targets.append(std::move(conn));
+        }
+    };
+
+    {
+        EpochDomain::ReadGuard guard(topicEpoch);
+        const TopicIndex *index = topics.load();
+        if (!index) return 0;
+
+        collect(index->exact, topic);
+        if (!index->prefix.isEmpty()) {
+            collect(index->prefix, QString());
+            for (qsizetype dot = topic.indexOf(u'.'); dot >= 0; dot = topic.indexOf(u'.', dot + 1))
+                collect(index->prefix, topic.left(dot + 1));
+        }
     }
+
+    // Connection matching several patterns gets the message once
+    if (lists > 1) {
+        QSet<ConnectionHandler*> seen;
+        targets.removeIf([&seen](const QSharedPointer<ConnectionHandler> &c) {
+            if (seen.contains(c.data())) return true;
+            seen.insert(c.data());
+            return false;
+        });
+    }
+
+    const int reached = targets.size();
+    fanOut(std::move(targets), data, key);
+    return reached;
+}
+
+//--------------------------------------------------------------------------------
+
+IoThread::IoThread(int index, QObject *parent)
+    : QThread(parent), index_(index), context_(new QObject), wheel_(new TimingWheel)
+{
+    setObjectName(QStringLiteral("io-%1").arg(index));
+    context_->moveToThread(this);
+    wheel_->moveToThread(this);
+
+    // Sockets parented to context are deleted on this thread when it finishes.
+    connect(this, &QThread::finished, context_, &QObject::deleteLater);
+    connect(this, &QThread::finished, wheel_, &QObject::deleteLater);
+}
+
+IoThread::~IoThread()
+{
+    quit();
+    wait();
+}
+
+//--------------------------------------------------------------------------------
+
+IoThreadPool::IoThreadPool(int count, Policy policy)
+    : policy(policy)
+{
+    for (int i = 0; i < count; ++i) {
+        auto *t = new IoThread(i);
+        t->start();
+        threads.append(t);
+    }
+}
+
+IoThreadPool::~IoThreadPool()
+{
+    qDeleteAll(threads);
+}
+
+IoThread *IoThreadPool::next()
+{
+    if (policy == LeastLoaded) {
+        IoThread *best = threads.first();
+        for (auto *t : threads) {
+            if (t->load() < best->load())
+                best = t;
+        }
+        return best;
+    }
+
+    quint32 i = quint32(cursor.fetchAndAddRelaxed(1));
+    return threads.at(int(i % quint32(threads.size())));
 }
 
 //--------------------------------------------------------------------------------
@@ -182,20 +1110,343 @@ void ConnectionManager::broadcast(const QByteArray &data) {
 TcpServer::TcpServer(QObject *parent)
     : QTcpServer(parent) {}
 
-static qint64 nextId = QDateTime::currentMSecsSinceEpoch();
+TcpServer::~TcpServer()
+{
+    closeShards();
+}
 
-void TcpServer::incomingConnection(qintptr descriptor) {
-    auto *socket = new QTcpSocket(this);
-    if (socket->setSocketDescriptor(descriptor)) {
-        qint64 connId = nextId++;
+void TcpServer::setIoThreads(int count, IoThreadPool::Policy policy)
+{
+    Q_ASSERT(!isListening());
+    ioThreads.reset(count > 0 ? new IoThreadPool(count, policy) : nullptr);
+}
 
-        auto *conn = createHandler(socket, connId, this);
-        ConnectionManager::instance().registerConnection(connId, conn);
+void TcpServer::setWorkerThreads(int count, bool pinThreads)
+{
+    Q_ASSERT(!isListening());
+    workerPool.reset(new WorkStealingExecutor(count, pinThreads));
+}
 
-        qDebug() << "Connection" << connId << "connected from" << socket->peerAddress();
+WorkStealingExecutor *TcpServer::workers() const
+{
+    return workerPool ? workerPool.data() : &WorkStealingExecutor::instance();
+}
+
+// Connection ids are unique process wide. Shards reserve them in blocks,
+// so this counter is touched once per IdBlock connections, not on every accept.
+static QAtomicInteger<qint64> nextId(QDateTime::currentMSecsSinceEpoch());
+static const qint64 IdBlock = 1024;
+
+//--------------------------------------------------------------------------------
+/*!
+ * \brief ListenerShard class is one SO_REUSEPORT listener living on an I/O thread.
+ *        Accepted sockets stay on that same thread.
+ */
+class ListenerShard : public QTcpServer {
+public:
+    ListenerShard(TcpServer *server, IoThread *io) : server(server), io(io) {}
+
+protected:
+    void incomingConnection(qintptr descriptor) override {
+        if (idNext == idEnd) {
+            idNext = nextId.fetchAndAddRelaxed(IdBlock);
+            idEnd  = idNext + IdBlock;
+        }
+        io->addLoad(1);
+        server->acceptOn(io, descriptor, idNext++);
+    }
+
+private:
+    TcpServer *server;
+    IoThread *io;
+
+    // Current block of reserved connection ids
+    qint64 idNext = 0;
+    qint64 idEnd = 0;
+};
+
+// Open a bound, listening, non-blocking socket with SO_REUSEPORT. Returns -1 on failure.
+static qintptr openReusePortSocket(const QHostAddress &address, quint16 port)
+{
+#if defined(Q_OS_UNIX) && defined(SO_REUSEPORT)
+    const bool v4 = address.protocol() == QAbstractSocket::IPv4Protocol;
+
+    int fd = ::socket(v4 ? AF_INET : AF_INET6, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+
+    int on = 1;
+    ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+        ::close(fd);
+        return -1;
+    }
+    ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+    ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    int rc;
+    if (v4) {
+        sockaddr_in sa{};
+        sa.sin_family = AF_INET;
+        sa.sin_port = htons(port);
+        sa.sin_addr.s_addr = htonl(address.toIPv4Address());
+        rc = ::bind(fd, reinterpret_cast<sockaddr*>(&sa), sizeof(sa));
     } else {
+        // Any (dual stack) or IPv6
+        int v6only = address.protocol() == QAbstractSocket::IPv6Protocol ? 1 : 0;
+        ::setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+
+        sockaddr_in6 sa{};
+        sa.sin6_family = AF_INET6;
+        sa.sin6_port = htons(port);
+        if (address.protocol() == QAbstractSocket::IPv6Protocol) {
+            Q_IPV6ADDR a = address.toIPv6Address();
+            memcpy(&sa.sin6_addr, &a, sizeof(a));
+        } else {
+            sa.sin6_addr = in6addr_any;
+        }
+        rc = ::bind(fd, reinterpret_cast<sockaddr*>(&sa), sizeof(sa));
+    }
+
+    if (rc < 0 || ::listen(fd, SOMAXCONN) < 0) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+#else
+    Q_UNUSED(address);
+    Q_UNUSED(port);
+    return -1;
+#endif
+}
+
+//--------------------------------------------------------------------------------
+
+bool TcpServer::listenSharded(const QHostAddress &address, quint16 port, int count)
+{
+    Q_ASSERT(!isListening() && shards.isEmpty());
+
+    if (count <= 0) count = QThread::idealThreadCount();
+    if (!ioThreads || ioThreads->count() != count)
+        setIoThreads(count);
+
+    for (int i = 0; i < count; ++i) {
+        IoThread *io = ioThreads->thread(i);
+
+        qintptr fd = openReusePortSocket(address, port);
+        if (fd < 0) {
+            qWarning() << "TcpServer: cannot open SO_REUSEPORT listener on port" << port;
+            closeShards();
+            return false;
+        }
+
+        auto *shard = new ListenerShard(this, io);
+        shard->moveToThread(io);
+        shards.append(shard);
+
+        // Socket notifier must be created on the shard's own thread
+        bool ok = false;
+        QMetaObject::invokeMethod(
+            shard,
+            [shard, fd, &ok]() { ok = shard->setSocketDescriptor(fd); },
+            Qt::BlockingQueuedConnection
+            );
+        if (!ok) {
+#ifdef Q_OS_UNIX
+            ::close(int(fd));
+#endif
+            closeShards();
+            return false;
+        }
+
+        // Port 0: the rest of the shards join the port the kernel picked
+        if (port == 0) port = shard->serverPort();
+    }
+    return true;
+}
+
+// Run this thread's event loop until done() or deadline; false on timeout
+template<class F>
+static bool waitFor(QDeadlineTimer deadline, F done)
+{
+    while (!done()) {
+        if (deadline.hasExpired()) return false;
+        QEventLoop loop;
+        const qint64 slice = deadline.isForever() ? 5 : qBound<qint64>(1, deadline.remainingTime(), 5);
+        QTimer::singleShot(int(slice), &loop, &QEventLoop::quit);
+        loop.exec();
+    }
+    return true;
+}
+
+// Time given to close connections once the drain deadline passed
+static const int CloseGraceMs = 1000;
+
+// Run fn for every handler on its owning thread, one batch per thread, all threads at once.
+// Waits until \a until for the batches; returns the sum of what fn returned.
+template<class F>
+static qint64 onOwningThreads(const QVector<QSharedPointer<ConnectionHandler>> &handlers, QDeadlineTimer until, F fn)
+{
+    struct State
+    {
+        QAtomicInteger<qint64> sum{0};
+        QAtomicInt remaining{0};
+    };
+    auto state = std::make_shared<State>();
+
+    QHash<QThread*, QVector<QSharedPointer<ConnectionHandler>>> groups;
+    for (const auto &h : handlers)
+        groups[h->thread()].append(h);
+
+    state->remaining.storeRelaxed(int(groups.size()));
+    for (auto it = groups.cbegin(); it != groups.cend(); ++it) {
+        const auto group = it.value();
+        QMetaObject::invokeMethod(group.first().data(), [group, state, fn]() {
+            qint64 sum = 0;
+            for (const auto &h : group)
+                sum += fn(h.data());
+            state->sum.fetchAndAddRelaxed(sum);
+            state->remaining.fetchAndSubRelease(1);
+        }, Qt::QueuedConnection);
+    }
+    waitFor(until, [&state]() {
+        return state->remaining.loadAcquire() == 0;
+    });
+    return state->sum.loadRelaxed();
+}
+
+TcpServer::ShutdownReport TcpServer::shutdown(QDeadlineTimer deadline)
+{
+    ShutdownReport report;
+    auto &manager = ConnectionManager::instance();
+
+    close();
+    closeShards();
+
+    // No new service() work from here on
+    auto handlers = manager.connectionList();
+    qint64 writtenBefore = 0;
+    for (const auto &h : handlers) {
+        h->draining.storeRelease(1);
+        writtenBefore += h->writtenMessages.loadRelaxed();
+    }
+
+    // Running and queued service() calls finish, they may still send
+    report.timedOut = !waitFor(deadline, [&handlers, &report]() {
+        report.busyStrands = 0;
+        for (const auto &h : handlers)
+            if (h->isServicing()) ++report.busyStrands;
+        return report.busyStrands == 0;
+    });
+
+    // Posted now, a flush runs behind every send already posted to the handler's thread
+    for (const auto &h : handlers)
+        QMetaObject::invokeMethod(h.data(), &ConnectionHandler::flushOutbound, Qt::QueuedConnection);
+    const bool flushed = waitFor(deadline, [&handlers, &manager]() {
+        for (const auto &h : handlers) {
+            if (h->queuedBytes() > 0 && manager.Connection(h->connectionId))
+                return false;   // still connected and writing
+        }
+        return true;
+    });
+    report.timedOut = report.timedOut || !flushed;
+
+    for (const auto &h : handlers)
+        report.flushed += h->writtenMessages.loadRelaxed();
+    report.flushed -= writtenBefore;
+
+    // Close on owning threads, all threads at once; late accepts are included.
+    // Sockets write what they still buffer before they disconnect, within the close budget.
+    const QDeadlineTimer closeBy = deadline.hasExpired() ? QDeadlineTimer(CloseGraceMs) : deadline;
+    handlers = manager.connectionList();
+    report.connections = int(handlers.size());
+    report.dropped = onOwningThreads(handlers, closeBy, [](ConnectionHandler *h) -> qint64 {
+        return h->closeNow();
+    });
+    waitFor(closeBy, [&handlers, &manager]() {
+        for (const auto &h : handlers) {
+            if (manager.Connection(h->connectionId))
+                return false;   // still writing
+        }
+        return true;
+    });
+
+    // Out of budget: abort the rest, what their sockets still buffered is lost
+    QVector<QSharedPointer<ConnectionHandler>> open;
+    for (const auto &h : handlers) {
+        if (manager.Connection(h->connectionId))
+            open.append(h);
+    }
+    if (!open.isEmpty()) {
+        report.timedOut = true;
+        report.droppedBytes = onOwningThreads(open, QDeadlineTimer(CloseGraceMs), [](ConnectionHandler *h) {
+            return h->abortNow();
+        });
+    }
+
+    // Closed ones unregistered on disconnect; the rest (e.g. thread already gone) now, while Qt is up
+    for (const auto &h : handlers)
+        manager.unregisterConnection(h->connectionId);
+
+    qDebug() << "Shutdown:" << report.connections << "connections," << report.flushed << "flushed,"
+             << report.dropped << "dropped" << report.droppedBytes << "bytes unwritten"
+             << (report.timedOut ? "(timed out)" : "");
+    return report;
+}
+
+void TcpServer::closeShards()
+{
+    for (auto *shard : shards) {
+        shard->deleteLater();   // closes on its own thread
+    }
+    shards.clear();
+}
+
+void TcpServer::incomingConnection(qintptr descriptor) {
+    qint64 connId = nextId.fetchAndAddRelaxed(1);
+
+    if (!ioThreads) {
+        acceptOn(nullptr, descriptor, connId);
+        return;
+    }
+
+    // Count it now, so LeastLoaded sees the connection before it lands.
+    IoThread *io = ioThreads->next();
+    io->addLoad(1);
+
+    QMetaObject::invokeMethod(
+        io->context(),
+        [this, io, descriptor, connId]() {
+            acceptOn(io, descriptor, connId);
+        },
+        Qt::QueuedConnection  // socket is created on its owning thread
+        );
+}
+
+void TcpServer::acceptOn(IoThread *io, qintptr descriptor, qint64 connId)
+{
+    QObject *owner = io ? io->context() : static_cast<QObject*>(this);
+
+    auto *socket = new QTcpSocket(owner);
+    if (!socket->setSocketDescriptor(descriptor)) {
         delete socket;
+        if (io) io->addLoad(-1);
+        return;
+    }
+
+    if (io) {
+        connect(socket, &QObject::destroyed, [io]{ io->addLoad(-1); });
     }
+
+    // Handler can't have a parent living on another thread.
+    auto *conn = createHandler(socket, connId, io ? nullptr : this);
+    conn->setExecutor(workers());
+    conn->setUpstream(upstreamLink);
+    if (!io && !timingWheel)
+        timingWheel = new TimingWheel(100, 512, this);
+    conn->setTimingWheel(io ? io->wheel() : timingWheel);
+    ConnectionManager::instance().registerConnection(connId, conn);
+
+    qDebug() << "Connection" << connId << "connected from" << socket->peerAddress();
 }
 
 //--------------------------------------------------------------------------------
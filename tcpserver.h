@@ -2,9 +2,15 @@
 Working model of this library.
 - QTcpSocket based server.
 - ConnectionManager class expose sendToConnection and broadcast.
-- ConnectionHandler class handles readyRead and disconnect signals.
-- WorkerThread class descendant of QRunnable spawned by ConnectionHandler to perform task on other threads.
+- ConnectionHandler class handles readyRead and disconnect signals, and cut incoming bytes into messages (see Framing).
+- WorkerThread class descendant of QRunnable spawned by ConnectionHandler to perform task on other threads,
+  run by a WorkStealingExecutor (executor.h), not by QThreadPool::globalInstance().
+  One connection has at most one WorkerTask queued or running (a strand), it drains every message queued for that connection,
+  so service() calls of one connection never overlap and keep arrival order, while different connections run in parallel.
 - TcpServer class descendant of QTcpServer handles incomingConnection signals. Assign id for each incoming connection and put on ConnectionManager.
+- IoThreadPool class holds N IoThread (each one running its own event loop), TcpServer hands accepted sockets to them.
+- TimingWheel class runs the timeouts of all connections of one thread (idle, heartbeat, login deadline) on a single timer.
+- UpstreamLink class (upstream.h) is the single pipeline to the upper layer, shared by all connections.
 
 # Workflow
 
@@ -21,10 +27,17 @@ UpperLayer <--> Server <--+-- Client
 ## Login and Session creation
 Upon connected client will send Logon message, handled by pushing it upstream (with connectionId attached to the message).
 When Logon accepted server should stamp this connection with clientId identification.
+ConnectionHandler::sendUpstream() does the pushing over the UpstreamLink set by TcpServer::setUpstream(): every request
+gets a request id, responses are matched by it and come back to UpstreamLink::received() with the connectionId and
+sessionId of the request. Requests are pipelined, small ones batched into one write, and replayed after a reconnect.
+MockUpstream stands in for the upper layer in tests.
 
 ## Push data dynamic
 When server accept data from upstream and have to pushed it down, it will search all relevant connection using clientId identification.
 Selection criteria based on somekind of mapping, but its outside of this topic.
+ConnectionManager provide one such mapping: sessions subscribe to topics ("quote.IDX.BBCA", or "quote.IDX.*" for every
+topic under "quote.IDX.", or "*" for all), publish(topic, data) sends data to every subscriber.
+Subscriptions belong to the connection the session is bound to, and are dropped when it is unregistered.
 
 ## Query-response dynamic
 Client can send query to server.
@@ -46,29 +59,188 @@ Its descendant should handle messaging with upper layer in the system
 
 Usage of these classes is by deriving ConnectionHandler and TcpServer for specific purpose.
 
+# Framing
+
+TCP does not keep message boundaries, one read may hold half a message or several of them.
+ConnectionHandler::setFraming() selects how incoming bytes are cut into messages:
+- RawFraming, bytes are passed to service() as they arrive (default).
+- LengthPrefixed, each message is preceded by its payload length, big endian, 1, 2 or 4 bytes.
+- Delimited, each message is terminated by a delimiter sequence (e.g. "\r\n").
+Complete messages are delivered to serviceBatch() as one MessageBatch per read, partial tail is kept for next read.
+Message larger than maxFrameSize aborts the connection.
+
+# Threading
+
+By default TcpServer accept and serve every socket on its own thread.
+Call TcpServer::setIoThreads() before listen() to spread sockets across a pool of I/O threads.
+Each accepted socket and its ConnectionHandler are created on, live on and are deleted on their owning I/O thread.
+ConnectionManager is thread safe, and ConnectionHandler::send() may be called from any thread.
+Its lookups and sends don't lock: the registry is sharded into copy-on-write snapshots, only register/unregister/setSessionId
+serialize on a mutex and copy the one shard they change.
+send() only appends to the connection's outbound queue. One posted flush per burst drains the whole queue on the socket's thread,
+coalescing small messages into writes of up to WriteChunk bytes.
+Read buffers, frames built by sendFrame() and write chunks come from BufferPool (bufferpool.h), per thread caches
+of size classed buffers, and go back to it once serviced or written.
+service() runs on WorkStealingExecutor::instance(), or on the server's own pool after TcpServer::setWorkerThreads().
+Each worker has its own task deque and idle workers steal from busy ones, there is no queue lock shared by all connections.
+TcpServer::listenSharded() goes one step further: every I/O thread owns its own SO_REUSEPORT listener,
+the kernel balances accepts between them and a connection never leaves the thread that accepted it.
+
+# Liveness
+
+ConnectionHandler stamps the time of the last incoming and outgoing bytes, a plain store per read or flush.
+setIdleTimeout() closes a connection that stays silent (dead NAT'd clients, missing heartbeats), setHeartbeat() sends
+a frame when nothing was sent for an interval, setLoginDeadline() closes a connection that binds no session in time.
+There is no QTimer per connection: each thread owning connections has one TimingWheel, every handler one entry on it,
+due at its earliest deadline. When the entry fires the stamps are checked, so activity never touches the wheel.
+
+# Shutdown
+
+TcpServer::shutdown(deadline) takes the server down without losing what is in flight:
+stop accepting, stop reading, let running and queued service() calls finish, flush outbound queues (behind sends
+already posted to the I/O threads), then close every connection with one posted batch per owning thread.
+A closing socket still writes what it buffered until the deadline, then it is aborted.
+ConnectionManager is left empty, so no handler is destroyed after QCoreApplication. The returned ShutdownReport
+counts messages flushed and messages dropped, and bytes lost in aborted sockets.
+
+# Backpressure
+
+ConnectionHandler::setWatermarks() bounds outbound bytes of a connection (queued + not yet written by the socket).
+Connection becomes congested above high watermark and recovers below low watermark.
+While congested, send() applies the slow consumer policy: DropNewest, DropOldest, Conflate (newer message replaces
+queued one with the same key) or Disconnect. send() and ConnectionManager send functions return SendResult,
+and ConnectionManager::pressureChanged() signal reports every congestion change.
+
  */
 
 #pragma once
 #include <QRunnable>
 #include <QByteArray>
+#include <QByteArrayView>
+#include <QVector>
 #include <QObject>
 #include <QPointer>
 #include <QTcpSocket>
 #include <QTcpServer>
 #include <QMutex>
+#include <QThread>
+#include <QAtomicInt>
+#include <QAtomicInteger>
+#include <QScopedPointer>
+#include <QTimer>
+#include <QDeadlineTimer>
+#include <QHostAddress>
+#include <QHash>
+#include <QSet>
+#include <memory>
+
+#include "executor.h"
+#include "epoch.h"
 
 class ConnectionHandler;
+class ListenerShard;
+class UpstreamLink;
+
+//--------------------------------------------------------------------------------
+/*!
+ * \brief TimingWheel class is a hashed timing wheel: one QTimer ticking every
+ *        tickMs serves any number of entries, schedule() and cancel() are O(1).
+ *        Entry due further than one revolution stays extra rounds in its slot.
+ *        Used from its own thread only, every IoThread has one (IoThread::wheel()).
+ *        The timer runs only while entries are scheduled.
+ */
+class TimingWheel : public QObject {
+    Q_OBJECT
+public:
+    class Entry {
+    public:
+        virtual ~Entry() { if (wheel) wheel->cancel(this); }
+        bool isScheduled() const { return wheel != nullptr; }
+
+    protected:
+        //! Called on the wheel's thread when due, the entry is no longer scheduled.
+        virtual void fire() {}
+
+    private:
+        friend class TimingWheel;
+        Entry *prev = nullptr;
+        Entry *next = nullptr;
+        TimingWheel *wheel = nullptr;
+        int rounds = 0;
+    };
+
+    explicit TimingWheel(int tickMs = 100, int slotCount = 512, QObject *parent = nullptr);
+    ~TimingWheel() override;
+
+    //! Monotonic clock in ms of due times and activity stamps.
+    static qint64 now();
+
+    //! Schedule (or move) entry to fire at \a due, rounded up to a tick.
+    void schedule(Entry *entry, qint64 due);
+    void cancel(Entry *entry);
+
+    int tick() const { return tickMs; }
+    int count() const { return size; }
+
+private slots:
+
+    void advance();
+
+private:
+
+    static void link(Entry *head, Entry *e);
+    static void unlink(Entry *e);
+
+    int tickMs;
+    int slotCount;
+    std::unique_ptr<Entry[]> heads;     // circular lists, head is a sentinel
+    int cursor = 0;
+    qint64 nextTick = 0;
+    int size = 0;
+    QTimer *timer;
+};
+
+//--------------------------------------------------------------------------------
+/*!
+ * \brief MessageBatch class holds complete messages cut from one read.
+ *        All messages share one buffer, at() gives views into it without copying.
+ */
+class MessageBatch {
+public:
+    MessageBatch() = default;
+    explicit MessageBatch(QByteArray raw) : buffer(std::move(raw)) { frames.append(Frame{0, int(buffer.size())}); }
+
+    int count() const { return frames.size(); }
+    bool isEmpty() const { return frames.isEmpty(); }
+
+    //! View of message i, valid as long as this batch lives.
+    QByteArrayView at(int i) const { return QByteArrayView(buffer).sliced(frames[i].offset, frames[i].size); }
+
+    //! Message i as QByteArray (shares the buffer when it is the whole buffer, copies otherwise).
+    QByteArray message(int i) const;
+
+private:
+    friend class ConnectionHandler;
+
+    struct Frame
+    {
+        int offset;
+        int size;
+    };
+
+    QByteArray buffer;
+    QVector<Frame> frames;
+};
 
 //--------------------------------------------------------------------------------
 
 class WorkerTask : public QRunnable {
 public:
-    WorkerTask(QByteArray data, QWeakPointer<ConnectionHandler> conn);
+    explicit WorkerTask(QWeakPointer<ConnectionHandler> conn);
 
     void run() override;
 
 private:
-    QByteArray data;
     QWeakPointer<ConnectionHandler> connection;
 };
 
@@ -84,32 +256,295 @@ private:
 class ConnectionHandler : public QObject {
     Q_OBJECT
 public:
+    enum Framing {
+        RawFraming,
+        LengthPrefixed,
+        Delimited
+    };
+
+    enum SlowConsumerPolicy {
+        DropNewest,
+        DropOldest,
+        Conflate,
+        Disconnect
+    };
+
+    enum Timeout {
+        IdleTimeout,    // nothing received for idleTimeout (heartbeat missed)
+        LoginTimeout    // no session bound within login deadline
+    };
+
+    enum SendResult {
+        Queued,
+        Conflated,      // replaced a queued message with the same key
+        Dropped,        // congested, message discarded
+        Disconnected,   // congested, connection is being closed
+        NotConnected
+    };
+
     explicit ConnectionHandler(QTcpSocket *socket, qint64 id, QObject *parent = nullptr);
 
     QPointer<QTcpSocket> socket() { return socket_; }
 
-    void setSessionId(qint64 id) { sessionId = id; }
+    //! Bind the logged-on session (any thread), lifts the login deadline.
+    void setSessionId(qint64 id);
 
     void setSelfWeak(QWeakPointer<ConnectionHandler> w) { self_ = std::move(w); }
 
-    void send(const QByteArray &data);
+    //! Executor running service(), WorkStealingExecutor::instance() when not set.
+    void setExecutor(WorkStealingExecutor *e) { executor = e; }
+
+    //! Pipeline to the upper layer (must outlive the handler), set from TcpServer::setUpstream().
+    void setUpstream(UpstreamLink *link) { upstream = link; }
+
+    //! Forward payload upstream tagged with this connection's ids, thread safe.
+    //! Returns the request id, 0 when there is no upstream or it refused the request.
+    quint64 sendUpstream(const QByteArray &payload);
+
+    //! Queue data for writing, thread safe. Consecutive sends are coalesced into one write.
+    //! \a key identifies messages that may replace each other under Conflate policy (0 never conflates).
+    SendResult send(const QByteArray &data, quint64 key = 0);
+
+    //! Largest coalesced write, bigger messages are written on their own.
+    static const int WriteChunk = 64 * 1024;
+
+    //! Send data as one message according to framing (length header or delimiter added).
+    //! Dropped, nothing written, when payload exceeds maxFrameSize or what the length field holds.
+    SendResult sendFrame(const QByteArray &payload);
+
+    /*!
+     * Select framing of incoming (and sendFrame) messages. Call from createHandler() or from
+     * handler's thread. \a lengthFieldSize is 1, 2 or 4 bytes, \a delimiter is for Delimited.
+     */
+    void setFraming(Framing f, int maxFrameSize = 16 * 1024 * 1024,
+                    int lengthFieldSize = 4, const QByteArray &delimiter = QByteArray());
+
+    //! Bound outbound bytes (\a high 0 means unbounded, which is the default).
+    void setWatermarks(qint64 high, qint64 low, SlowConsumerPolicy policy = Disconnect);
+
+    bool isCongested() const { return congested.loadRelaxed() != 0; }
+
+    //! Bytes queued by send() plus bytes still buffered by the socket.
+    qint64 queuedBytes() const { return pendingBytes.loadRelaxed() + socketBytes.loadRelaxed(); }
+
+    //! Close connection after \a ms without incoming data, 0 disables (default). Call on handler's thread.
+    void setIdleTimeout(int ms);
+
+    //! Send \a payload with sendFrame() after \a intervalMs without outgoing data, 0 disables.
+    void setHeartbeat(int intervalMs, const QByteArray &payload);
+
+    //! Close connection unless a session is bound within \a ms of accepting, 0 disables.
+    void setLoginDeadline(int ms);
+
+    //! Wheel running the timeouts, the one of handler's thread (set by TcpServer).
+    void setTimingWheel(TimingWheel *w);
+
+    //! TimingWheel::now() of the last incoming / outgoing bytes.
+    qint64 lastReceived() const { return lastRead.loadRelaxed(); }
+    qint64 lastSent() const { return lastWrite.loadRelaxed(); }
+
+    //! Called on handler's thread when a timeout passes. Default aborts the connection.
+    virtual void expired(Timeout reason);
 
     //! Implement this to handle incoming messages
     virtual void service(const QByteArray &data) { Q_UNUSED(data); }
 
+    //! Implement this to handle all messages of one read at once (default calls service() for each).
+    virtual void serviceBatch(const MessageBatch &batch);
+
+signals:
+
+    void pressureChanged(qint64 connectionId, bool congested);
+
 private slots:
 
     void onReadyRead();
     void onDisconnected();
+    void flushOutbound();
+    void onBytesWritten();
 
 private:
 
     QPointer<QTcpSocket> socket_;
 
     qint64 connectionId;
-    qint64 sessionId;
+    QAtomicInteger<qint64> sessionId{0};    // stamped by ConnectionManager::setSessionId()
 
     QWeakPointer<ConnectionHandler> self_;
+
+    // Cut complete frames out of inbound into batch; false on protocol violation
+    bool extractFrames(MessageBatch &batch);
+
+    // Queue batch on the strand, schedule a WorkerTask when strand is idle
+    void dispatch(MessageBatch batch);
+
+    // Run queued batches in order (called by WorkerTask)
+    void drainStrand();
+    friend class WorkerTask;
+
+    // send() for handler's own thread, writes without posting a flush (used by broadcast)
+    SendResult sendLocal(const QByteArray &data, quint64 key);
+    friend class ConnectionManager;
+
+    // Shutdown: stop reading, report strand state, close dropping what is left (handler's thread).
+    // closeNow() returns messages dropped and lets the socket finish writing; abortNow() returns
+    // bytes the socket had not written.
+    friend class TcpServer;
+    QAtomicInt draining{0};
+    QAtomicInteger<qint64> writtenMessages{0};
+    bool isServicing();
+    int closeNow();
+    qint64 abortNow();
+
+    // Queue data applying backpressure; flush is set when caller must flush
+    SendResult enqueue(const QByteArray &data, quint64 key, bool &flush);
+
+    // Framing state, touched only on handler's thread
+    Framing framing = RawFraming;
+    int maxFrameSize = 16 * 1024 * 1024;
+    int lengthFieldSize = 4;
+    QByteArray delimiter;
+    QByteArray inbound;     // reassembly buffer (partial frame)
+
+    // Strand: batches waiting for service(), at most one WorkerTask drains them
+    QMutex strandMutex;
+    QVector<MessageBatch> strandQueue;
+    bool strandScheduled = false;
+    WorkStealingExecutor *executor = nullptr;
+
+    UpstreamLink *upstream = nullptr;
+
+    // Liveness, handler's thread: one wheel entry due at the earliest deadline
+    struct LivenessEntry : TimingWheel::Entry
+    {
+        ConnectionHandler *owner = nullptr;
+        void fire() override { owner->checkLiveness(); }
+    };
+    LivenessEntry liveness;
+    QPointer<TimingWheel> wheel;
+    int idleTimeout = 0;
+    int heartbeatInterval = 0;
+    int loginTimeout = 0;
+    QByteArray heartbeatPayload;
+    qint64 acceptedAt;
+    QAtomicInteger<qint64> lastRead;
+    QAtomicInteger<qint64> lastWrite;
+
+    // Check stamps against timeouts, then reschedule
+    void checkLiveness();
+    void scheduleLiveness();
+
+    // Outbound queue: filled by send() from any thread, drained by flushOutbound() on handler's thread
+    struct Outbound
+    {
+        QByteArray data;
+        quint64 key;
+    };
+
+    QMutex outMutex;
+    QVector<Outbound> outQueue;
+    bool flushPending = false;
+    bool waitingForSocket = false;  // socket buffer full, messages held in outQueue
+
+    // Apply slow consumer policy, outMutex held
+    SendResult sendCongested(const QByteArray &data, quint64 key);
+
+    // Clear congestion once below low watermark (handler's thread)
+    void checkRecovered();
+
+    // Backpressure
+    qint64 highWatermark = 0;
+    qint64 lowWatermark = 0;
+    SlowConsumerPolicy slowPolicy = Disconnect;
+    QAtomicInteger<qint64> pendingBytes{0};   // in outQueue
+    QAtomicInteger<qint64> socketBytes{0};    // in socket's write buffer
+    QAtomicInt congested{0};
+    QAtomicInt abortPosted{0};      // Disconnect policy fired, abort queued once
+};
+
+//--------------------------------------------------------------------------------
+/*!
+ * \brief ShardedSnapshotMap class is a read-optimized qint64 keyed hash map.
+ *        Keys are spread over Shards immutable QHash snapshots. Readers take no
+ *        lock: they count themselves in the shard's EpochDomain (one atomic
+ *        increment on a counter of that shard only) and read its current
+ *        snapshot. A writer copies only the shard it touches and publishes the
+ *        copy; the replaced one is freed once no reader can hold it. Writers
+ *        must be serialized by the caller.
+ */
+template<class V>
+class ShardedSnapshotMap {
+public:
+    static const int Shards = 64;
+
+    V value(qint64 key, const V &defaultValue = V()) const {
+        const Shard &s = shards[shardOf(key)];
+        EpochDomain::ReadGuard guard(s.domain);
+        const Hash *hash = s.hash.load();
+        return hash ? hash->value(key, defaultValue) : defaultValue;
+    }
+
+    bool contains(qint64 key) const {
+        const Shard &s = shards[shardOf(key)];
+        EpochDomain::ReadGuard guard(s.domain);
+        const Hash *hash = s.hash.load();
+        return hash && hash->contains(key);
+    }
+
+    // --- writers ---
+
+    void insert(qint64 key, const V &v) {
+        Shard &s = shards[shardOf(key)];
+        Hash *copy = detach(s);
+        copy->insert(key, v);
+        s.hash.publish(s.domain, copy);
+    }
+
+    V take(qint64 key) {
+        Shard &s = shards[shardOf(key)];
+        Hash *copy = detach(s);
+        V v = copy->take(key);
+        s.hash.publish(s.domain, copy);
+        return v;
+    }
+
+    void remove(qint64 key) { (void)take(key); }
+
+    //! Free the replaced snapshots of \a key's shard now, waiting for its readers to leave.
+    void synchronize(qint64 key) { shards[shardOf(key)].domain.synchronize(); }
+
+    //! Visit every entry, shard by shard (each shard is a consistent snapshot).
+    template<class F>
+    void forEach(F f) const {
+        for (const Shard &s : shards) {
+            EpochDomain::ReadGuard guard(s.domain);
+            const Hash *hash = s.hash.load();
+            if (!hash) continue;
+            for (auto it = hash->constBegin(); it != hash->constEnd(); ++it)
+                f(it.key(), it.value());
+        }
+    }
+
+private:
+    using Hash = QHash<qint64, V>;
+
+    struct Shard
+    {
+        EpochDomain domain;
+        EpochPtr<Hash> hash;
+    };
+
+    static int shardOf(qint64 key) {
+        // Fibonacci hashing, sequential ids spread evenly
+        return int((quint64(key) * Q_UINT64_C(0x9E3779B97F4A7C15)) >> 58);
+    }
+
+    static Hash *detach(const Shard &s) {
+        const Hash *hash = s.hash.load();
+        return hash ? new Hash(*hash) : new Hash;
+    }
+
+    Shard shards[Shards];
 };
 
 //--------------------------------------------------------------------------------
@@ -127,27 +562,146 @@ public:
     QSharedPointer<ConnectionHandler> Connection(qint64 id);
     QSharedPointer<ConnectionHandler> ConnectionBySession(qint64 id);
 
-    void sendToConnection(qint64 id, const QByteArray &data);
-    void sendToSession(qint64 id, const QByteArray &data);
+    //! Every registered connection, without locking.
+    QVector<QSharedPointer<ConnectionHandler>> connectionList() const;
 
-    void broadcast(const QByteArray &data);
+    ConnectionHandler::SendResult sendToConnection(qint64 id, const QByteArray &data, quint64 key = 0);
+    ConnectionHandler::SendResult sendToSession(qint64 id, const QByteArray &data, quint64 key = 0);
+
+    /*!
+     * Send data to every connection, posting one batch per I/O thread.
+     * Returns number of connections congested at the time of call (their slow consumer policy applies).
+     */
+    int broadcast(const QByteArray &data, quint64 key = 0);
+
+    //! Subscribe session to topic or wildcard ("a.b.*", "*"); false if session has no connection.
+    bool subscribe(qint64 sessionId, const QString &topic);
+    void unsubscribe(qint64 sessionId, const QString &topic);
+
+    //! Send data to subscribers of topic, without locking. Returns number of connections reached.
+    int publish(const QString &topic, const QByteArray &data, quint64 key = 0);
+
+signals:
+
+    //! Connection crossed its high (congested) or low (recovered) watermark.
+    void pressureChanged(qint64 connectionId, bool congested);
 
 private:
 
+    // Serializes writers; lookups and sends read the sharded maps without it
     QMutex mutex;
 
     // Maps connectionID to socket
-    QMap<qint64, QSharedPointer<ConnectionHandler>> connections;
+    ShardedSnapshotMap<QSharedPointer<ConnectionHandler>> connections;
 
     // Maps sessionId to connectionID
-    QMap<qint64, qint64> sessionToConnectionIDs;
+    ShardedSnapshotMap<qint64> sessionToConnectionIDs;
+
+    // Maps connectionID to sessionId (writers only, under mutex)
+    QHash<qint64, qint64> connectionToSessionIDs;
+
+    // Connections grouped by owning thread, copy-on-write under mutex: register/unregister copy
+    // only the group they change, the other groups' handler lists stay shared with the old snapshot
+    struct BroadcastSnapshot
+    {
+        struct Group
+        {
+            QThread *thread;
+            QPointer<QObject> context;      // lives on the group's thread
+            QVector<QSharedPointer<ConnectionHandler>> handlers;
+        };
+        QVector<Group> groups;
+    };
+    EpochDomain snapshotEpoch;
+    EpochPtr<BroadcastSnapshot> snapshot;
+
+    // One context object per thread owning connections
+    QHash<QThread*, QObject*> threadContexts;
+
+    // Post one batch per owning thread
+    void fanOut(QVector<QSharedPointer<ConnectionHandler>> targets, const QByteArray &data, quint64 key);
+
+    // Topic subscriptions, copy-on-write: publish reads a snapshot in topicEpoch, writers swap it under mutex
+    struct TopicIndex
+    {
+        struct Subscriber
+        {
+            qint64 connectionId;
+            QWeakPointer<ConnectionHandler> handler;
+        };
+        using Subscribers = QVector<Subscriber>;
+
+        QHash<QString, std::shared_ptr<const Subscribers>> exact;
+        QHash<QString, std::shared_ptr<const Subscribers>> prefix;     // "a.b." for "a.b.*", "" for "*"
+    };
+    EpochDomain topicEpoch;
+    EpochPtr<TopicIndex> topics;
 
-    // Maps connectionID to sessionId
-    QMap<qint64, qint64> connectionToSessionIDs;
+    QHash<qint64, QSet<QString>> connectionTopics;  // connectionId -> its topics (writers only, under mutex)
+
+    void dropSubscriber(TopicIndex &index, qint64 connectionId, const QString &topic);
+    void removeSubscriptions(qint64 connectionId);
 
     ConnectionManager() = default;
 };
 
+//--------------------------------------------------------------------------------
+/*!
+ * \brief IoThread class is a single reactor: a QThread running its own event loop.
+ *        Sockets accepted onto it are parented to context() and live on this thread.
+ */
+class IoThread : public QThread {
+    Q_OBJECT
+public:
+    explicit IoThread(int index, QObject *parent = nullptr);
+    ~IoThread() override;
+
+    int index() const { return index_; }
+
+    //! Object living on this thread, use it as context for queued calls.
+    QObject *context() const { return context_; }
+
+    //! Timeouts of connections owned by this thread.
+    TimingWheel *wheel() const { return wheel_; }
+
+    //! Number of connections currently owned by this thread.
+    int load() const { return load_.loadRelaxed(); }
+    void addLoad(int delta) { load_.fetchAndAddRelaxed(delta); }
+
+private:
+    int index_;
+    QObject *context_;
+    TimingWheel *wheel_;
+    QAtomicInt load_{0};
+};
+
+//--------------------------------------------------------------------------------
+/*!
+ * \brief IoThreadPool class owns and starts N IoThread, and selects
+ *        the thread for each new connection.
+ */
+class IoThreadPool {
+public:
+    enum Policy {
+        RoundRobin,
+        LeastLoaded
+    };
+
+    explicit IoThreadPool(int count, Policy policy = RoundRobin);
+    ~IoThreadPool();
+
+    int count() const { return threads.size(); }
+    IoThread *thread(int i) const { return threads.at(i); }
+
+    //! Select thread for next connection according to policy.
+    IoThread *next();
+
+private:
+    QList<IoThread*> threads;
+    Policy policy;
+    QAtomicInt cursor{0};
+};
+
 //--------------------------------------------------------------------------------
 
 /*!
@@ -161,8 +715,56 @@ class TcpServer : public QTcpServer {
     Q_OBJECT
 public:
     explicit TcpServer(QObject *parent = nullptr);
+    ~TcpServer() override;
+
+    /*!
+     * Spread accepted sockets across \a count I/O threads (0 serve everything on this thread).
+     * Must be called before listen().
+     */
+    void setIoThreads(int count, IoThreadPool::Policy policy = IoThreadPool::RoundRobin);
+
+    /*!
+     * Run service() of this server's connections on its own \a count worker threads
+     * (pinned to CPUs if \a pinThreads), instead of the shared WorkStealingExecutor::instance().
+     * Must be called before listen().
+     */
+    void setWorkerThreads(int count, bool pinThreads = false);
+
+    //! Executor running service() of this server's connections.
+    WorkStealingExecutor *workers() const;
+
+    struct ShutdownReport
+    {
+        int connections = 0;    //!< connections closed
+        qint64 flushed = 0;     //!< outbound messages written while draining
+        qint64 dropped = 0;     //!< outbound messages unwritten and inbound messages unserviced at close
+        qint64 droppedBytes = 0;    //!< bytes left in socket write buffers when closing ran out of time
+        int busyStrands = 0;    //!< connections still in service() when the wait ended
+        bool timedOut = false;  //!< deadline cut the drain short
+    };
+
+    /*!
+     * Stop accepting and reading, wait for running and queued service() calls, flush outbound queues,
+     * then close every connection (in parallel, one batch per owning thread) and empty ConnectionManager.
+     * A closing socket writes what it buffered until \a deadline, then it is aborted.
+     * Waiting ends at \a deadline, closing still happens after it. Call on the server's thread.
+     */
+    ShutdownReport shutdown(QDeadlineTimer deadline = QDeadlineTimer(5000));
+
+    //! Upper layer link handed to every accepted connection (not owned, must outlive them).
+    void setUpstream(UpstreamLink *link) { upstreamLink = link; }
+    UpstreamLink *upstream() const { return upstreamLink; }
+
+    /*!
+     * Listen with one SO_REUSEPORT socket per I/O thread (\a shards <= 0 use idealThreadCount()).
+     * Creates the I/O threads when needed. Use instead of listen(); unix only.
+     */
+    bool listenSharded(const QHostAddress &address, quint16 port, int shards = 0);
+    void closeShards();
+    bool isSharded() const { return !shards.isEmpty(); }
 
     //! Implement this to create your custom ConnectionHandler.
+    //! With I/O threads it is called on the socket's owning thread and \a parent is nullptr.
     virtual ConnectionHandler* createHandler(QTcpSocket *socket, qint64 id, QObject *parent = nullptr)
     {
         return new ConnectionHandler(socket, id, parent);
@@ -171,6 +773,25 @@ public:
 protected:
 
     void incomingConnection(qintptr socketDescriptor) override;
+
+private:
+
+    friend class ListenerShard;
+
+    // Create socket and handler on current thread (io == nullptr for this server thread)
+    void acceptOn(IoThread *io, qintptr socketDescriptor, qint64 connId);
+
+    // Declared first: outlives the I/O threads that dispatch to it
+    QScopedPointer<WorkStealingExecutor> workerPool;
+    QScopedPointer<IoThreadPool> ioThreads;
+
+    UpstreamLink *upstreamLink = nullptr;
+
+    // Timeouts of connections served on this server's thread
+    TimingWheel *timingWheel = nullptr;
+
+    // One listener per I/O thread, in sharded mode
+    QList<ListenerShard*> shards;
 };
 
 //--------------------------------------------------------------------------------
@@ -0,0 +1,377 @@
+#include "upstream.h"
+#include "tcpserver.h"
+#include "bufferpool.h"
+#include <QMetaObject>
+#include <QMutexLocker>
+#include <QDebug>
+#include <QThread>
+#include <QtEndian>
+#include <cstring>
+
+//--------------------------------------------------------------------------------
+
+void UpstreamMessage::encode(QByteArray &out) const
+{
+    const qsizetype at = out.size();
+    out.resize(at + HeaderSize + payload.size());
+
+    uchar *h = reinterpret_cast<uchar*>(out.data() + at);
+    qToBigEndian<quint32>(quint32(HeaderSize - 4 + payload.size()), h);
+    qToBigEndian<quint64>(requestId, h + 4);
+    qToBigEndian<qint64>(connectionId, h + 12);
+    qToBigEndian<qint64>(sessionId, h + 20);
+    if (!payload.isEmpty())
+        memcpy(h + HeaderSize, payload.constData(), size_t(payload.size()));
+}
+
+bool UpstreamMessage::decode(QByteArray &inbound, QVector<UpstreamMessage> &messages, int maxFrameSize)
+{
+    const char *p = inbound.constData();
+    const qsizetype size = inbound.size();
+    qsizetype pos = 0;
+
+    while (size - pos >= HeaderSize) {
+        const uchar *h = reinterpret_cast<const uchar*>(p + pos);
+        const qint64 len = qFromBigEndian<quint32>(h);
+        if (len < HeaderSize - 4 || len - (HeaderSize - 4) > maxFrameSize) return false;
+        if (size - pos - 4 < len) break;   // partial
+
+        UpstreamMessage m;
+        m.requestId = qFromBigEndian<quint64>(h + 4);
+        m.connectionId = qFromBigEndian<qint64>(h + 12);
+        m.sessionId = qFromBigEndian<qint64>(h + 20);
+        m.payload = QByteArray(p + pos + HeaderSize, len - (HeaderSize - 4));
+        messages.append(std::move(m));
+        pos += 4 + len;
+    }
+
+    if (pos > 0)
+        inbound = pos < size ? inbound.mid(pos) : QByteArray();
+    return true;
+}
+
+//--------------------------------------------------------------------------------
+
+UpstreamLink::UpstreamLink(QObject *parent)
+    : QObject(parent), socket_(new QTcpSocket(this)), reconnectTimer(new QTimer(this))
+{
+    reconnectTimer->setSingleShot(true);
+
+    connect(reconnectTimer, &QTimer::timeout, this, &UpstreamLink::reconnect);
+    connect(socket_, &QTcpSocket::connected, this, &UpstreamLink::onConnected);
+    connect(socket_, &QTcpSocket::disconnected, this, &UpstreamLink::onDisconnected);
+    connect(socket_, &QTcpSocket::errorOccurred, this, &UpstreamLink::onError);
+    connect(socket_, &QTcpSocket::readyRead, this, &UpstreamLink::onReadyRead);
+}
+
+UpstreamLink::~UpstreamLink()
+{
+    closing = true;
+    socket_->disconnect(this);
+}
+
+void UpstreamLink::connectTo(const QHostAddress &addr, quint16 p)
+{
+    Q_ASSERT(thread() == QThread::currentThread());
+
+    address = addr;
+    port = p;
+    closing = false;
+    delay = minDelay;
+    reconnectTimer->stop();
+    socket_->abort();
+    socket_->connectToHost(address, port);
+}
+
+void UpstreamLink::close()
+{
+    closing = true;
+    reconnectTimer->stop();
+    socket_->disconnectFromHost();
+}
+
+void UpstreamLink::setPipelineDepth(int depth)
+{
+    QMutexLocker locker(&mutex);
+    pipelineDepth = qMax(depth, 1);
+}
+
+void UpstreamLink::setReplayLimit(int requests)
+{
+    QMutexLocker locker(&mutex);
+    replayLimit = qMax(requests, 1);
+}
+
+void UpstreamLink::setReconnectDelay(int minMs, int maxMs)
+{
+    minDelay = qMax(minMs, 1);
+    maxDelay = qMax(maxMs, minDelay);
+    delay = minDelay;
+}
+
+int UpstreamLink::pendingCount()
+{
+    QMutexLocker locker(&mutex);
+    return int(queue.size() + inFlight.size());
+}
+
+quint64 UpstreamLink::request(qint64 connectionId, qint64 sessionId, const QByteArray &payload)
+{
+    const quint64 id = nextRequestId.fetchAndAddRelaxed(1);
+    Pending p{id, connectionId, sessionId, BufferPool::acquire(UpstreamMessage::HeaderSize + payload.size())};
+    UpstreamMessage{id, connectionId, sessionId, payload}.encode(p.frame);
+
+    bool post = false;
+    {
+        QMutexLocker locker(&mutex);
+        if (queue.size() + inFlight.size() >= replayLimit) {
+            locker.unlock();
+            BufferPool::release(std::move(p.frame));
+            return 0;
+        }
+        queue.append(std::move(p));
+        if (!flushPending && connected.loadAcquire()) {
+            flushPending = true;
+            post = true;
+        }
+    }
+    if (post) {
+        QMetaObject::invokeMethod(
+            this,
+            &UpstreamLink::flush,
+            Qt::QueuedConnection  // ensure it runs in socket's thread
+            );
+    }
+    return id;
+}
+
+void UpstreamLink::flush()
+{
+    QVector<QByteArray> frames;
+    {
+        QMutexLocker locker(&mutex);
+        flushPending = false;
+        if (!connected.loadRelaxed())
+            return;
+
+        // Pipelining: write what fits the window, the rest goes out as responses come in
+        const int n = qMin(pipelineDepth - int(inFlight.size()), int(queue.size()));
+        if (n <= 0)
+            return;
+        frames.reserve(n);
+        for (int i = 0; i < n; ++i) {
+            frames.append(queue[i].frame);
+            inFlight.insert(queue[i].requestId, std::move(queue[i]));
+        }
+        queue.remove(0, n);
+    }
+
+    // Small frames are joined into chunks, one write per WriteChunk bytes
+    QByteArray chunk = BufferPool::acquire(WriteChunk);
+    for (const QByteArray &frame : frames) {
+        if (chunk.size() + frame.size() > WriteChunk && !chunk.isEmpty()) {
+            socket_->write(chunk);
+            chunk.resize(0);    // keeps capacity
+        }
+        if (frame.size() >= WriteChunk) {
+            socket_->write(frame);
+            continue;
+        }
+        chunk.append(frame);
+    }
+    if (!chunk.isEmpty())
+        socket_->write(chunk);
+    socket_->flush();
+    BufferPool::release(std::move(chunk));
+}
+
+void UpstreamLink::onReadyRead()
+{
+    inbound.append(socket_->readAll());
+
+    QVector<UpstreamMessage> messages;
+    if (!UpstreamMessage::decode(inbound, messages, maxFrameSize)) {
+        qWarning() << "Upstream frame too large, reconnecting";
+        socket_->abort();
+        return;
+    }
+
+    bool more;
+    QVector<QByteArray> answered;
+    {
+        QMutexLocker locker(&mutex);
+        for (auto it = messages.begin(); it != messages.end(); ) {
+            if (it->requestId == 0) {
+                ++it;   // push
+                continue;
+            }
+            auto req = inFlight.find(it->requestId);
+            if (req == inFlight.end()) {
+                it = messages.erase(it);    // answer to a failed request, or duplicate after replay
+                continue;
+            }
+            // Route by the request when upstream leaves ids out, a Logon response may set sessionId
+            if (it->connectionId == 0) it->connectionId = req->connectionId;
+            if (it->sessionId == 0) it->sessionId = req->sessionId;
+            answered.append(std::move(req->frame));
+            inFlight.erase(req);
+            ++it;
+        }
+        more = !queue.isEmpty() && !flushPending && inFlight.size() < pipelineDepth;
+        if (more) flushPending = true;
+    }
+    for (auto &frame : answered)
+        BufferPool::release(std::move(frame));
+
+    for (const auto &m : messages)
+        received(m);
+
+    if (more)
+        flush();
+}
+
+void UpstreamLink::received(const UpstreamMessage &message)
+{
+    auto &manager = ConnectionManager::instance();
+    auto conn = message.sessionId ? manager.ConnectionBySession(message.sessionId)
+                                  : manager.Connection(message.connectionId);
+    if (conn)
+        conn->sendFrame(message.payload);
+}
+
+void UpstreamLink::onConnected()
+{
+    socket_->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+    delay = minDelay;
+    {
+        QMutexLocker locker(&mutex);
+        connected.storeRelease(1);
+        flushPending = true;
+    }
+    emit connectionChanged(true);
+
+    // Replays what was unanswered when the last connection dropped
+    flush();
+}
+
+void UpstreamLink::onDisconnected()
+{
+    QVector<Pending> failed;
+    {
+        QMutexLocker locker(&mutex);
+        if (!connected.loadRelaxed())
+            return;
+        connected.storeRelease(0);
+        requeue(failed);
+    }
+    inbound.clear();
+    emit connectionChanged(false);
+
+    for (const auto &p : failed)
+        emit requestFailed(p.requestId, p.connectionId, p.sessionId);
+
+    scheduleReconnect();
+}
+
+void UpstreamLink::onError()
+{
+    // Connect attempt failed; a drop of an established connection goes through onDisconnected()
+    if (!connected.loadRelaxed() && socket_->state() == QAbstractSocket::UnconnectedState)
+        scheduleReconnect();
+}
+
+void UpstreamLink::requeue(QVector<Pending> &failed)
+{
+    QVector<Pending> replay;
+    replay.reserve(inFlight.size() + queue.size());
+    for (auto &p : inFlight)
+        replay.append(std::move(p));
+    for (auto &p : queue)
+        replay.append(std::move(p));
+    inFlight.clear();
+
+    // Only shrinks when setReplayLimit() lowered it, request() keeps below it otherwise
+    const int drop = int(replay.size()) - replayLimit;
+    if (drop > 0) {
+        failed = replay.mid(0, drop);
+        replay.remove(0, drop);
+    }
+    queue = std::move(replay);
+}
+
+void UpstreamLink::scheduleReconnect()
+{
+    if (closing || reconnectTimer->isActive())
+        return;
+    reconnectTimer->start(delay);
+    delay = qMin(delay * 2, maxDelay);
+}
+
+void UpstreamLink::reconnect()
+{
+    if (!closing && socket_->state() == QAbstractSocket::UnconnectedState)
+        socket_->connectToHost(address, port);
+}
+
+//--------------------------------------------------------------------------------
+
+MockUpstream::MockUpstream(QObject *parent)
+    : QTcpServer(parent)
+{
+    connect(this, &QTcpServer::newConnection, this, &MockUpstream::onNewConnection);
+}
+
+void MockUpstream::onNewConnection()
+{
+    while (QTcpSocket *peer = nextPendingConnection()) {
+        peers.insert(peer, QByteArray());
+        connect(peer, &QTcpSocket::readyRead, this, [this, peer]() { onReadyRead(peer); });
+        connect(peer, &QTcpSocket::disconnected, this, [this, peer]() {
+            peers.remove(peer);
+            peer->deleteLater();
+        });
+    }
+}
+
+void MockUpstream::onReadyRead(QTcpSocket *peer)
+{
+    auto it = peers.find(peer);
+    if (it == peers.end()) return;
+
+    it->append(peer->readAll());
+    QVector<UpstreamMessage> messages;
+    if (!UpstreamMessage::decode(*it, messages, 16 * 1024 * 1024)) {
+        peer->abort();
+        return;
+    }
+
+    // Answers to one read go out in one write, like a pipelining server would
+    QByteArray out;
+    for (const auto &m : messages) {
+        ++requests;
+        emit requestReceived(m.requestId, m.connectionId, m.sessionId, m.payload);
+
+        UpstreamMessage response = m;
+        if (!responder || responder(m, response))
+            response.encode(out);
+    }
+    if (!out.isEmpty())
+        peer->write(out);
+}
+
+void MockUpstream::push(qint64 connectionId, qint64 sessionId, const QByteArray &payload)
+{
+    QByteArray out;
+    UpstreamMessage{0, connectionId, sessionId, payload}.encode(out);
+    for (auto it = peers.begin(); it != peers.end(); ++it)
+        it.key()->write(out);
+}
+
+void MockUpstream::dropConnections()
+{
+    const auto sockets = peers.keys();
+    for (QTcpSocket *peer : sockets)
+        peer->abort();
+}
+
+//--------------------------------------------------------------------------------
@@ -0,0 +1,199 @@
+#pragma once
+#include <QObject>
+#include <QByteArray>
+#include <QVector>
+#include <QList>
+#include <QMap>
+#include <QHash>
+#include <QMutex>
+#include <QTimer>
+#include <QTcpSocket>
+#include <QTcpServer>
+#include <QHostAddress>
+#include <QAtomicInt>
+#include <QAtomicInteger>
+#include <functional>
+
+//--------------------------------------------------------------------------------
+/*!
+ * \brief UpstreamMessage is one frame of the pipeline to the upper layer.
+ *        requestId correlates a response with its request, 0 marks data
+ *        upstream pushes on its own. connectionId and sessionId tell which
+ *        client it belongs to.
+ *
+ *        On the wire, big endian:
+ *        quint32 length of the rest | quint64 requestId | qint64 connectionId | qint64 sessionId | payload
+ */
+struct UpstreamMessage
+{
+    quint64 requestId = 0;
+    qint64 connectionId = 0;
+    qint64 sessionId = 0;
+    QByteArray payload;
+
+    static const int HeaderSize = 4 + 3 * 8;
+
+    //! Append the frame of this message to out.
+    void encode(QByteArray &out) const;
+
+    //! Cut complete frames out of inbound, partial tail is kept; false if a frame exceeds maxFrameSize.
+    static bool decode(QByteArray &inbound, QVector<UpstreamMessage> &messages, int maxFrameSize);
+};
+
+//--------------------------------------------------------------------------------
+/*!
+ * \brief UpstreamLink class is the single pipeline between the server and the
+ *        upper layer. Requests of all clients are multiplexed on one persistent
+ *        connection:
+ *        - request() may be called from any thread, it tags the payload with a
+ *          request id and queues it; one posted flush per burst joins the queued
+ *          frames into writes of up to WriteChunk bytes;
+ *        - up to pipelineDepth requests are on the wire unanswered, responses may
+ *          come in any order and are matched by request id, so they reach the
+ *          connectionId/sessionId that asked even if upstream doesn't echo them;
+ *        - when the connection drops, unanswered requests are written again, in
+ *          request order, once reconnected. At most replayLimit requests are
+ *          unanswered (queued or in flight), connected or not; request() refuses
+ *          more.
+ *
+ *        Lives on the thread that created it (or was moved to), where the socket
+ *        is read and received() is called.
+ *        Implement received() to handle responses (e.g. Logon accepted), the
+ *        default sends the payload down to the client as a frame.
+ */
+class UpstreamLink : public QObject {
+    Q_OBJECT
+public:
+    explicit UpstreamLink(QObject *parent = nullptr);
+    ~UpstreamLink() override;
+
+    //! Connect and keep reconnecting until close(). Call on link's thread.
+    void connectTo(const QHostAddress &address, quint16 port);
+    void close();
+
+    bool isConnected() const { return connected.loadAcquire() != 0; }
+
+    //! Forward payload of a client upstream, thread safe. Returns its request id, 0 when refused (replay limit reached).
+    quint64 request(qint64 connectionId, qint64 sessionId, const QByteArray &payload);
+
+    //! Requests not answered yet (queued and in flight).
+    int pendingCount();
+
+    //! Unanswered requests on the wire at once, further ones wait queued.
+    void setPipelineDepth(int depth);
+
+    //! Unanswered requests kept (and replayed after a reconnect); request() refuses beyond it.
+    void setReplayLimit(int requests);
+
+    //! Reconnect delay, doubles from \a minMs up to \a maxMs while upstream is unreachable.
+    void setReconnectDelay(int minMs, int maxMs);
+
+    //! Largest coalesced write, bigger frames are written on their own.
+    static const int WriteChunk = 64 * 1024;
+
+    //! Handle a response or push from upstream (link's thread). Default sends payload to the
+    //! message's session, or its connection when sessionId is 0, with ConnectionHandler::sendFrame().
+    virtual void received(const UpstreamMessage &message);
+
+signals:
+
+    void connectionChanged(bool connected);
+
+    //! Request dropped unanswered, it didn't fit the replay limit.
+    void requestFailed(quint64 requestId, qint64 connectionId, qint64 sessionId);
+
+private slots:
+
+    void onConnected();
+    void onDisconnected();
+    void onError();
+    void onReadyRead();
+    void reconnect();
+    void flush();
+
+private:
+
+    struct Pending
+    {
+        quint64 requestId;
+        qint64 connectionId;
+        qint64 sessionId;
+        QByteArray frame;   // encoded once, written again on replay
+    };
+
+    // Move in-flight requests back in front of the queue, trim to replayLimit; mutex held
+    void requeue(QVector<Pending> &failed);
+
+    void scheduleReconnect();
+
+    QTcpSocket *socket_;
+    QTimer *reconnectTimer;
+    QHostAddress address;
+    quint16 port = 0;
+    bool closing = true;
+    int minDelay = 100;
+    int maxDelay = 10000;
+    int delay = 100;
+
+    QByteArray inbound;     // partial frame, link's thread only
+    int maxFrameSize = 16 * 1024 * 1024;
+    QAtomicInt connected{0};
+    QAtomicInteger<quint64> nextRequestId{1};
+
+    // Filled by request() from any thread, drained by flush() on link's thread
+    QMutex mutex;
+    QVector<Pending> queue;             // not written yet
+    QMap<quint64, Pending> inFlight;    // written, unanswered, in request order
+    bool flushPending = false;
+    int pipelineDepth = 1024;
+    int replayLimit = 64 * 1024;
+};
+
+//--------------------------------------------------------------------------------
+/*!
+ * \brief MockUpstream class is a local upper layer for tests. It accepts
+ *        UpstreamLink connections and answers every request with responder()
+ *        (echo when not set), can push to the links and drop them to exercise
+ *        reconnect and replay.
+ *
+ *        MockUpstream upstream;
+ *        upstream.listen(QHostAddress::LocalHost);
+ *        link.connectTo(QHostAddress::LocalHost, upstream.serverPort());
+ */
+class MockUpstream : public QTcpServer {
+    Q_OBJECT
+public:
+    //! Fill response and return true to answer, false to leave the request unanswered.
+    using Responder = std::function<bool(const UpstreamMessage &request, UpstreamMessage &response)>;
+
+    explicit MockUpstream(QObject *parent = nullptr);
+
+    void setResponder(Responder r) { responder = std::move(r); }
+
+    //! Send unsolicited data (request id 0) over every link.
+    void push(qint64 connectionId, qint64 sessionId, const QByteArray &payload);
+
+    //! Abort every link connection, listening goes on.
+    void dropConnections();
+
+    int linkCount() const { return peers.size(); }
+    quint64 requestCount() const { return requests; }
+
+signals:
+
+    void requestReceived(quint64 requestId, qint64 connectionId, qint64 sessionId, const QByteArray &payload);
+
+private slots:
+
+    void onNewConnection();
+
+private:
+
+    void onReadyRead(QTcpSocket *peer);
+
+    Responder responder;
+    QHash<QTcpSocket*, QByteArray> peers;   // peer -> its partial frame
+    quint64 requests = 0;
+};
+
+//--------------------------------------------------------------------------------